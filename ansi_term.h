@@ -2,12 +2,26 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
 #include "nob.h"
 
 #ifndef ANSI_TERM_READ_BUFFER_SIZE
 #  define ANSI_TERM_READ_BUFFER_SIZE 1024
 #endif // ANSI_TERM_READ_BUFFER_SIZE
 
+// A frame bigger than that is written out in parts so huge listings don't have to fit in memory at once
+#ifndef ANSI_TERM_FRAME_MAX_SIZE
+#  define ANSI_TERM_FRAME_MAX_SIZE (8*1024*1024)
+#endif // ANSI_TERM_FRAME_MAX_SIZE
+
+// How long an escape waits for the rest of a sequence before it counts as the escape key by itself
+#ifndef ANSI_TERM_ESCAPE_TIMEOUT_MS
+#  define ANSI_TERM_ESCAPE_TIMEOUT_MS 50
+#endif // ANSI_TERM_ESCAPE_TIMEOUT_MS
+
 #define ANSI_TERM_ENABLE_ALT_BUFFER   "\x1b[?1049h"
 #define ANSI_TERM_DISABLE_ALT_BUFFER  "\x1b[?1049l"
 
@@ -25,6 +39,12 @@
 #define ANSI_TERM_CLEAR_FROM_CURSOR_TO_SCREEN_START  "\x1b[1J"
 #define ANSI_TERM_CLEAR_ENTIRE_SCREEN                "\x1b[2J"
 
+#define ANSI_TERM_KEY_ESCAPE     27
+#define ANSI_TERM_KEY_BACKSPACE  127
+#define ANSI_TERM_KEY_CTRL(c)    ((c) & 0x1f)
+// An escape sequence like an arrow key, ansi_term_read_key() already consumed all of its bytes
+#define ANSI_TERM_KEY_SEQUENCE   256
+
 static inline void ansi_term_start();
 static inline void ansi_term_end();
 
@@ -37,6 +57,18 @@ void ansi_term_move_cursor(int x, int y);
 bool ansi_term_read(Nob_String_View *read_data);
 bool ansi_term_read_line(Nob_String_View *read_data);
 
+bool ansi_term_raw_start();
+void ansi_term_raw_end();
+int ansi_term_read_key();
+
+// Frames are composed in one reusable buffer without going through printf, and handed to the terminal with
+// a single write by ansi_term_frame_flush(). Whatever stdio still holds is written before the frame.
+void ansi_term_frame_append(const char *data, size_t size);
+static inline void ansi_term_frame_cstr(const char *cstr);
+void ansi_term_frame_u64(uint64_t value);
+void ansi_term_frame_newline();
+void ansi_term_frame_flush();
+
 #endif // _ANSI_TERM_H
 
 
@@ -136,4 +168,148 @@ bool ansi_term_read_line(Nob_String_View *read_data) {
   return true;
 }
 
+static struct termios ansi_term_cooked_mode;
+static bool ansi_term_raw_enabled = false;
+static struct sigaction ansi_term_old_sigint;
+static struct sigaction ansi_term_old_sigterm;
+
+// Puts the terminal back before the signal does what it did before raw mode, usually ending the program
+static void ansi_term_raw_signal(int sig) {
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &ansi_term_cooked_mode);
+  sigaction(sig, sig == SIGINT ? &ansi_term_old_sigint : &ansi_term_old_sigterm, NULL);
+  raise(sig);
+}
+
+// Hands over every key as soon as it's pressed and stops echoing them, false when stdin isn't a terminal.
+// The terminal is restored by ansi_term_raw_end(), on exit() and on SIGINT or SIGTERM.
+bool ansi_term_raw_start() {
+  static bool exit_hook_installed = false;
+  if (ansi_term_raw_enabled) return true;
+  if (!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &ansi_term_cooked_mode) < 0) return false;
+  if (!exit_hook_installed) exit_hook_installed = atexit(ansi_term_raw_end) == 0;
+
+  struct sigaction action = { .sa_handler = ansi_term_raw_signal };
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, &ansi_term_old_sigint);
+  sigaction(SIGTERM, &action, &ansi_term_old_sigterm);
+
+  struct termios raw = ansi_term_cooked_mode;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) < 0) {
+    sigaction(SIGINT, &ansi_term_old_sigint, NULL);
+    sigaction(SIGTERM, &ansi_term_old_sigterm, NULL);
+    return false;
+  }
+
+  ansi_term_raw_enabled = true;
+  return true;
+}
+
+void ansi_term_raw_end() {
+  if (!ansi_term_raw_enabled) return;
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &ansi_term_cooked_mode);
+  sigaction(SIGINT, &ansi_term_old_sigint, NULL);
+  sigaction(SIGTERM, &ansi_term_old_sigterm, NULL);
+  ansi_term_raw_enabled = false;
+}
+
+// Reads a single byte, -1 once stdin is closed or when nothing came within `timeout_ms` (never with -1)
+static int ansi_term_read_byte(int timeout_ms) {
+  if (timeout_ms >= 0) {
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    int ready = 0;
+    do {
+      ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready <= 0) return -1;
+  }
+
+  unsigned char c = 0;
+  ssize_t n = 0;
+  do {
+    n = read(STDIN_FILENO, &c, 1);
+  } while (n < 0 && errno == EINTR);
+  return n == 1 ? (int)c : -1;
+}
+
+// Returns the next byte typed or -1 once stdin is closed. An escape followed right away by more bytes is
+// a sequence sent by a key like the arrows, it's read to its end and ANSI_TERM_KEY_SEQUENCE is returned.
+int ansi_term_read_key() {
+  int c = ansi_term_read_byte(-1);
+  if (c != ANSI_TERM_KEY_ESCAPE) return c;
+
+  int next = ansi_term_read_byte(ANSI_TERM_ESCAPE_TIMEOUT_MS);
+  if (next < 0) return ANSI_TERM_KEY_ESCAPE;
+  if (next == '[') {
+    // CSI: parameter and intermediate bytes up to a final byte from '@' to '~'
+    int b = 0;
+    do {
+      b = ansi_term_read_byte(ANSI_TERM_ESCAPE_TIMEOUT_MS);
+    } while (0x20 <= b && b < 0x40);
+  } else if (next == 'O') {
+    // SS3: a single final byte, some terminals send the arrows like that
+    ansi_term_read_byte(ANSI_TERM_ESCAPE_TIMEOUT_MS);
+  }
+  return ANSI_TERM_KEY_SEQUENCE;
+}
+
+static Nob_String_Builder ansi_term_frame = {0};
+
+void ansi_term_frame_append(const char *data, size_t size) {
+  if (size == 0) return;
+  if (ansi_term_frame.count > 0 && ansi_term_frame.count + size > ANSI_TERM_FRAME_MAX_SIZE) ansi_term_frame_flush();
+  nob_da_append_many(&ansi_term_frame, data, size);
+}
+
+static inline void ansi_term_frame_cstr(const char *cstr) {
+  ansi_term_frame_append(cstr, strlen(cstr));
+}
+
+void ansi_term_frame_u64(uint64_t value) {
+  static const char pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+  char digits[20];
+  size_t at = sizeof(digits);
+  while (value >= 100) {
+    size_t pair = (size_t)(value % 100)*2;
+    value /= 100;
+    digits[--at] = pairs[pair + 1];
+    digits[--at] = pairs[pair];
+  }
+  if (value >= 10) {
+    digits[--at] = pairs[value*2 + 1];
+    digits[--at] = pairs[value*2];
+  } else {
+    digits[--at] = (char)('0' + value);
+  }
+  ansi_term_frame_append(digits + at, sizeof(digits) - at);
+}
+
+void ansi_term_frame_newline() {
+  if (ansi_term_alt_buffer_enabled) ansi_term_frame_cstr("\x1b[1E");
+  else ansi_term_frame_cstr("\n");
+}
+
+void ansi_term_frame_flush() {
+  fflush(stdout);
+  const char *data = ansi_term_frame.items;
+  size_t left = ansi_term_frame.count;
+  while (left > 0) {
+    ssize_t n = write(STDOUT_FILENO, data, left);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      nob_log(NOB_ERROR, "Could not write frame: %s", strerror(errno));
+      break;
+    }
+    data += n;
+    left -= (size_t)n;
+  }
+  // The buffer is kept for the next frame
+  ansi_term_frame.count = 0;
+}
+
 #endif // ANSI_TERM_IMPLEMENTATION
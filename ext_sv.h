@@ -1,9 +1,46 @@
 #ifndef _EXTENDED_STRING_VIEW_H
 #define _EXTENDED_STRING_VIEW_H
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "nob.h"
 
+// ntemp - growable temporary storage for the ntemp_* helpers
+//
+// Unlike nob's fixed NOB_TEMP_CAPACITY storage this is a chain of chunks that grows on demand, so it never
+// runs out. Rewinding keeps the chunks around to be reused, only ntemp_free() gives them back.
+//
+//     Ntemp_Checkpoint cp = ntemp_save();
+//     const char *lowered = ntemp_sv_ascii_to_lower(sv);
+//     ntemp_rewind(cp);
+#ifndef NTEMP_CHUNK_SIZE
+#define NTEMP_CHUNK_SIZE (64*1024)
+#endif // NTEMP_CHUNK_SIZE
+
+typedef struct Ntemp_Chunk Ntemp_Chunk;
+
+typedef struct {
+  Ntemp_Chunk *chunk;
+  size_t chunk_used;
+  size_t used;
+} Ntemp_Checkpoint;
+
+typedef struct {
+  size_t used;
+  size_t high_water;
+  size_t capacity;
+  size_t chunks;
+} Ntemp_Stats;
+
+void *ntemp_alloc(size_t size);
+Ntemp_Checkpoint ntemp_save(void);
+void ntemp_rewind(Ntemp_Checkpoint checkpoint);
+void ntemp_reset(void);
+Ntemp_Stats ntemp_stats(void);
+void ntemp_free(void);
+
 const char *ntemp_sv_ascii_to_lower(Nob_String_View sv);
 const char *ntemp_zstr_ascii_to_lower(const char * zstr);
 
@@ -12,11 +49,21 @@ Nob_String_View ntemp_sv_dup_buf(const char *buf, size_t buf_size);
 
 Nob_String_View ntemp_sv_replace_char_with(Nob_String_View sv, char from, const char *to);
 
+// Substring search, returns the offset of the first occurrence of the needle or -1. On x86 the haystack is
+// scanned 32 (AVX2) or 16 (SSE2) bytes at a time for positions where both the first and the last byte of the
+// needle match, only those get compared in full. The kernel is picked once at runtime from what the CPU
+// supports, anything else uses the scalar loop.
+ptrdiff_t sv_find_buf(Nob_String_View base, const char *needle, size_t needle_size);
+// Same but 'A'-'Z' match 'a'-'z', every other byte has to match exactly
+ptrdiff_t sv_find_buf_ascii_ignore_case(Nob_String_View base, const char *needle, size_t needle_size);
+
 bool zstr_includes_sv(const char *base, Nob_String_View needle_sv);
 #define zstr_includes_zstr(base, needle) zstr_includes_sv(base, nob_sv_from_cstr(needle))
 bool sv_includes_buf(Nob_String_View sv, const char *needle, size_t needle_size);
 #define sv_includes_cstr(base, needle) sv_includes_buf(base, needle, strlen(needle))
 #define sv_includes_sv(base, needle) sv_includes_buf(base, (needle).data, (needle).count)
+bool sv_includes_buf_ascii_ignore_case(Nob_String_View sv, const char *needle, size_t needle_size);
+#define sv_includes_sv_ascii_ignore_case(base, needle) sv_includes_buf_ascii_ignore_case(base, (needle).data, (needle).count)
 
 #endif // _EXTENDED_STRING_VIEW_H
 
@@ -25,8 +72,93 @@ bool sv_includes_buf(Nob_String_View sv, const char *needle, size_t needle_size)
 
 #ifdef EXTENDED_SV_IMPLEMENTATION
 
+struct Ntemp_Chunk {
+  Ntemp_Chunk *next;
+  size_t capacity;
+  size_t used;
+  char data[];
+};
+
+static Ntemp_Chunk *ntemp_first = NULL;
+static Ntemp_Chunk *ntemp_current = NULL;
+static Ntemp_Stats ntemp_state = {0};
+
+static Ntemp_Chunk *ntemp_new_chunk(size_t capacity) {
+  Ntemp_Chunk *chunk = malloc(sizeof(Ntemp_Chunk) + capacity);
+  NOB_ASSERT(chunk != NULL && "Buy more RAM lol");
+  chunk->next = NULL;
+  chunk->capacity = capacity;
+  chunk->used = 0;
+  ntemp_state.capacity += capacity;
+  ntemp_state.chunks++;
+  return chunk;
+}
+
+void *ntemp_alloc(size_t requested_size) {
+  size_t word_size = sizeof(uintptr_t);
+  size_t size = (requested_size + word_size - 1)/word_size*word_size;
+
+  if (ntemp_current == NULL) {
+    if (ntemp_first == NULL) ntemp_first = ntemp_new_chunk(size > NTEMP_CHUNK_SIZE ? size : NTEMP_CHUNK_SIZE);
+    ntemp_current = ntemp_first;
+    ntemp_current->used = 0;
+  }
+
+  while (ntemp_current->capacity - ntemp_current->used < size) {
+    Ntemp_Chunk *next = ntemp_current->next;
+    // A chunk left over from before a rewind is reused if it fits, otherwise a new one goes in front of it
+    if (next == NULL || next->capacity < size) {
+      Ntemp_Chunk *chunk = ntemp_new_chunk(size > NTEMP_CHUNK_SIZE ? size : NTEMP_CHUNK_SIZE);
+      chunk->next = next;
+      ntemp_current->next = chunk;
+    }
+    ntemp_current = ntemp_current->next;
+    ntemp_current->used = 0;
+  }
+
+  void *result = ntemp_current->data + ntemp_current->used;
+  ntemp_current->used += size;
+  ntemp_state.used += size;
+  if (ntemp_state.used > ntemp_state.high_water) ntemp_state.high_water = ntemp_state.used;
+  return result;
+}
+
+Ntemp_Checkpoint ntemp_save(void) {
+  return (Ntemp_Checkpoint) {
+    .chunk = ntemp_current,
+    .chunk_used = ntemp_current ? ntemp_current->used : 0,
+    .used = ntemp_state.used,
+  };
+}
+
+void ntemp_rewind(Ntemp_Checkpoint checkpoint) {
+  ntemp_current = checkpoint.chunk;
+  if (ntemp_current) ntemp_current->used = checkpoint.chunk_used;
+  ntemp_state.used = checkpoint.used;
+}
+
+void ntemp_reset(void) {
+  ntemp_rewind((Ntemp_Checkpoint) {0});
+}
+
+Ntemp_Stats ntemp_stats(void) {
+  return ntemp_state;
+}
+
+void ntemp_free(void) {
+  Ntemp_Chunk *chunk = ntemp_first;
+  while (chunk) {
+    Ntemp_Chunk *next = chunk->next;
+    free(chunk);
+    chunk = next;
+  }
+  ntemp_first = NULL;
+  ntemp_current = NULL;
+  memset(&ntemp_state, 0, sizeof(ntemp_state));
+}
+
 const char *ntemp_sv_ascii_to_lower(Nob_String_View sv) {
-  char *zstr = nob_temp_alloc(sv.count + 1);
+  char *zstr = ntemp_alloc(sv.count + 1);
 
   for (size_t i = 0; i < sv.count; ++i) {
     char c = sv.data[i];
@@ -42,7 +174,7 @@ const char *ntemp_sv_ascii_to_lower(Nob_String_View sv) {
 
 const char *ntemp_zstr_ascii_to_lower(const char *base) {
   size_t len = strlen(base);
-  char *zstr = nob_temp_alloc(len + 1);
+  char *zstr = ntemp_alloc(len + 1);
 
   for (size_t i = 0; i < len; ++i) {
     char c = base[i];
@@ -58,14 +190,16 @@ const char *ntemp_zstr_ascii_to_lower(const char *base) {
 
 
 Nob_String_View ntemp_sv_dup_zstr(const char *zstr) {
+  size_t len = strlen(zstr);
+  char *data = memcpy(ntemp_alloc(len + 1), zstr, len + 1);
   return (Nob_String_View) {
-    .data = nob_temp_strdup(zstr),
-    .count = strlen(zstr),
+    .data = data,
+    .count = len,
   };
 }
 
 Nob_String_View ntemp_sv_dup_buf(const char *buf, size_t buf_size) {
-  char *data = (char*)memcpy(nob_temp_alloc(buf_size), buf, buf_size);
+  char *data = (char*)memcpy(ntemp_alloc(buf_size), buf, buf_size);
   return (Nob_String_View) {
     .data = data,
     .count = buf_size,
@@ -85,7 +219,7 @@ Nob_String_View ntemp_sv_replace_char_with(Nob_String_View sv, char from, const
     }
   }
 
-  char *dest = nob_temp_alloc(final_len + 1);
+  char *dest = ntemp_alloc(final_len + 1);
   size_t j = 0;
   for (size_t i = 0; i < sv.count; ++i) {
     if (sv.data[i] == from) {
@@ -118,7 +252,7 @@ Nob_String_View ntemp_sv_replace_substr_with(Nob_String_View sv, const char *fro
     final_len++;
   }
 
-  char *dest = nob_temp_alloc(final_len + 1);
+  char *dest = ntemp_alloc(final_len + 1);
 
   size_t j = 0;
   for (size_t i = 0; i < sv.count; ++i) {
@@ -141,52 +275,156 @@ Nob_String_View ntemp_sv_replace_substr_with(Nob_String_View sv, const char *fro
 }
 
 
-bool zstr_includes_sv(const char *base, Nob_String_View needle) {
-  size_t base_len = strlen(base);
-  if (base_len < needle.count) return false;
-  if (base_len == needle.count) {
-    for (size_t i = 0; i < base_len; ++i) {
-      if (base[i] != needle.data[i]) return false;
-    }
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#  define EXT_SV_X86_SIMD
+#  include <immintrin.h>
+#endif // x86 with GNU C
+
+static inline char ext_sv_ascii_fold(char c, bool ignore_case) {
+  return (ignore_case && 'A' <= c && c <= 'Z') ? c + 32 : c;
+}
 
-    return true;
+// Compares the middle of a candidate, its first and last byte already matched
+static inline bool ext_sv_match_at(const char *base, const char *needle, size_t needle_size, bool ignore_case) {
+  if (!ignore_case) return needle_size <= 2 || memcmp(base + 1, needle + 1, needle_size - 2) == 0;
+  for (size_t j = 1; j + 1 < needle_size; ++j) {
+    if (ext_sv_ascii_fold(base[j], true) != ext_sv_ascii_fold(needle[j], true)) return false;
   }
+  return true;
+}
 
-  for (size_t i = 0; i < base_len - needle.count; ++i) {
-    bool found = true;
-    for (size_t j = 0; j < needle.count; ++j) {
-      if (base[i+j] != needle.data[j]) {
-	found = false;
-	break;
-      }
-    }
-    if (found) return true;
+// Checks every position from `start` on, both the fallback and the tail left over by the vector kernels
+static ptrdiff_t ext_sv_find_scalar(const char *base, size_t base_size, const char *needle, size_t needle_size,
+                                    size_t start, bool ignore_case) {
+  char first = ext_sv_ascii_fold(needle[0], ignore_case);
+  char last = ext_sv_ascii_fold(needle[needle_size - 1], ignore_case);
+  for (size_t i = start; i + needle_size <= base_size; ++i) {
+    if (ext_sv_ascii_fold(base[i], ignore_case) != first) continue;
+    if (ext_sv_ascii_fold(base[i + needle_size - 1], ignore_case) != last) continue;
+    if (ext_sv_match_at(base + i, needle, needle_size, ignore_case)) return (ptrdiff_t)i;
   }
+  return -1;
+}
 
-  return false;
+#ifdef EXT_SV_X86_SIMD
+// Lowercases 'A'-'Z' lanes: shifted by 128-'A' they're the only ones below -128+26 as signed bytes
+__attribute__((target("sse2")))
+static inline __m128i ext_sv_fold_sse2(__m128i v) {
+  __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, _mm_set1_epi8((char)(128 - 'A'))), _mm_set1_epi8(-128 + 26));
+  return _mm_add_epi8(v, _mm_and_si128(upper, _mm_set1_epi8(32)));
 }
 
-bool sv_includes_buf(Nob_String_View base, const char *needle, size_t needle_size) {
-  if (base.count < needle_size) return false;
-  if (base.count == needle_size) {
-    for (size_t i = 0; i < base.count; ++i) {
-      if (base.data[i] != needle[i]) return false;
+__attribute__((target("sse2")))
+static ptrdiff_t ext_sv_find_sse2(const char *base, size_t base_size, const char *needle, size_t needle_size, bool ignore_case) {
+  const __m128i first = _mm_set1_epi8(ext_sv_ascii_fold(needle[0], ignore_case));
+  const __m128i last = _mm_set1_epi8(ext_sv_ascii_fold(needle[needle_size - 1], ignore_case));
+  size_t i = 0;
+  for (; i + needle_size - 1 + 16 <= base_size; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i*)(base + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i*)(base + i + needle_size - 1));
+    if (ignore_case) {
+      block_first = ext_sv_fold_sse2(block_first);
+      block_last = ext_sv_fold_sse2(block_last);
+    }
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, block_first),
+                                                              _mm_cmpeq_epi8(last, block_last)));
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (ext_sv_match_at(base + at, needle, needle_size, ignore_case)) return (ptrdiff_t)at;
+      mask &= mask - 1;
     }
-    return true;
   }
+  return ext_sv_find_scalar(base, base_size, needle, needle_size, i, ignore_case);
+}
 
-  for (size_t i = 0; i < base.count - needle_size; ++i) {
-    bool found = true;
-    for (size_t j = 0; j < needle_size; ++j) {
-      if (base.data[i+j] != needle[j]) {
-	found = false;
-	break;
-      }
+__attribute__((target("avx2")))
+static inline __m256i ext_sv_fold_avx2(__m256i v) {
+  __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8(-128 + 26), _mm256_add_epi8(v, _mm256_set1_epi8((char)(128 - 'A'))));
+  return _mm256_add_epi8(v, _mm256_and_si256(upper, _mm256_set1_epi8(32)));
+}
+
+__attribute__((target("avx2")))
+static ptrdiff_t ext_sv_find_avx2(const char *base, size_t base_size, const char *needle, size_t needle_size, bool ignore_case) {
+  const __m256i first = _mm256_set1_epi8(ext_sv_ascii_fold(needle[0], ignore_case));
+  const __m256i last = _mm256_set1_epi8(ext_sv_ascii_fold(needle[needle_size - 1], ignore_case));
+  size_t i = 0;
+  for (; i + needle_size - 1 + 32 <= base_size; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i*)(base + i));
+    __m256i block_last = _mm256_loadu_si256((const __m256i*)(base + i + needle_size - 1));
+    if (ignore_case) {
+      block_first = ext_sv_fold_avx2(block_first);
+      block_last = ext_sv_fold_avx2(block_last);
+    }
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, block_first),
+                                                                    _mm256_cmpeq_epi8(last, block_last)));
+    while (mask) {
+      size_t at = i + (size_t)__builtin_ctz(mask);
+      if (ext_sv_match_at(base + at, needle, needle_size, ignore_case)) return (ptrdiff_t)at;
+      mask &= mask - 1;
     }
-    if (found) return true;
   }
+  // Less than a block is left, SSE2 may still get one more in before the scalar loop
+  ptrdiff_t tail = ext_sv_find_sse2(base + i, base_size - i, needle, needle_size, ignore_case);
+  return tail < 0 ? -1 : (ptrdiff_t)i + tail;
+}
+#endif // EXT_SV_X86_SIMD
+
+static ptrdiff_t ext_sv_find_fallback(const char *base, size_t base_size, const char *needle, size_t needle_size, bool ignore_case) {
+  return ext_sv_find_scalar(base, base_size, needle, needle_size, 0, ignore_case);
+}
+
+typedef ptrdiff_t (*Ext_Sv_Find_Kernel)(const char *base, size_t base_size, const char *needle, size_t needle_size, bool ignore_case);
+
+// Resolved on first use, every thread ends up storing the same kernel. The accesses are atomic so searching
+// from several threads at once is fine.
+static Ext_Sv_Find_Kernel ext_sv_find_kernel = NULL;
+
+#if defined(__GNUC__) || defined(__clang__)
+#  define EXT_SV_LOAD_RELAXED(ptr)         __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#  define EXT_SV_STORE_RELAXED(ptr, value) __atomic_store_n(ptr, value, __ATOMIC_RELAXED)
+#else
+#  define EXT_SV_LOAD_RELAXED(ptr)         (*(ptr))
+#  define EXT_SV_STORE_RELAXED(ptr, value) (*(ptr) = (value))
+#endif // GNU C
+
+static Ext_Sv_Find_Kernel ext_sv_pick_find_kernel(void) {
+#ifdef EXT_SV_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return ext_sv_find_avx2;
+  if (__builtin_cpu_supports("sse2")) return ext_sv_find_sse2;
+#endif // EXT_SV_X86_SIMD
+  return ext_sv_find_fallback;
+}
+
+static ptrdiff_t ext_sv_find(Nob_String_View base, const char *needle, size_t needle_size, bool ignore_case) {
+  if (needle_size == 0) return 0;
+  if (base.count < needle_size) return -1;
+  Ext_Sv_Find_Kernel kernel = EXT_SV_LOAD_RELAXED(&ext_sv_find_kernel);
+  if (kernel == NULL) {
+    kernel = ext_sv_pick_find_kernel();
+    EXT_SV_STORE_RELAXED(&ext_sv_find_kernel, kernel);
+  }
+  return kernel(base.data, base.count, needle, needle_size, ignore_case);
+}
+
+ptrdiff_t sv_find_buf(Nob_String_View base, const char *needle, size_t needle_size) {
+  return ext_sv_find(base, needle, needle_size, false);
+}
+
+ptrdiff_t sv_find_buf_ascii_ignore_case(Nob_String_View base, const char *needle, size_t needle_size) {
+  return ext_sv_find(base, needle, needle_size, true);
+}
+
+bool zstr_includes_sv(const char *base, Nob_String_View needle) {
+  return sv_find_buf(nob_sv_from_cstr(base), needle.data, needle.count) >= 0;
+}
+
+bool sv_includes_buf(Nob_String_View base, const char *needle, size_t needle_size) {
+  return sv_find_buf(base, needle, needle_size) >= 0;
+}
 
-  return false;
+bool sv_includes_buf_ascii_ignore_case(Nob_String_View base, const char *needle, size_t needle_size) {
+  return sv_find_buf_ascii_ignore_case(base, needle, needle_size) >= 0;
 }
 
 #endif // EXTENDED_SV_IMPLEMENTATION
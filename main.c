@@ -4,6 +4,14 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include <pthread.h>
 
 
 #define NOB_FREE(ptr) do { if (ptr) { free((void*)ptr); ptr = NULL; } } while(0)
@@ -21,36 +29,34 @@ void sb_free(Nob_String_Builder *sb) {
 
 #include "ext_sv.h"
 #include "ansi_term.h"
+// Generated by nob.c into the build folder
+#include "mori_fold_table.h"
 
 #define MORI_FILE_NAME "mori-mori"
-#define MORI_VERSION 0
-#define MORI_FULL_VERSION "0.1.0"
-
-#define list_remove(l, index)                                \
-do {                                                         \
-  if ((l)->count > 0 && index < (l)->count) {  \
-    for (size_t i = index; i < (l)->count - 1; ++i) {        \
-      (l)->items[i] = (l)->items[i + 1];                     \
-    }                                                        \
-    (l)->count--;                                            \
-  }                                                          \
-} while (0)
+#define MORI_VERSION 1
+#define MORI_FULL_VERSION "0.2.0"
 
 #define flush() fflush(stdout)
 
 typedef unsigned char byte_t;
 
+// Every tree points into the same forest buffer (mori.buffer) so a view is only an offset and a length
+// into it. That caps the buffer at 4GiB, same as the string heap of the morimori file. While the buffer
+// is a read-only mapping, offsets past its end point into mori.overlay instead.
 typedef struct {
-  String_Builder *buffer;
-  size_t index;
-  size_t length;
+  uint32_t index;
+  uint32_t length;
 } Buffered_String_View;
 
 #define BufSV_Fmt      "%.*s"
-#define BufSV_Arg(bsv) (int) (bsv).length, ((bsv).buffer->items + (bsv).index)
-#define BufSV_Arg_Clamp(bsv, max) (int) ((bsv).length > (max) ? (max) : (bsv).length), ((bsv).buffer->items + (bsv).index)
+#define BufSV_Arg(bsv) (int) (bsv).length, bufsv_data(bsv)
+#define BufSV_Arg_Clamp(bsv, max) (int) ((bsv).length > (max) ? (max) : (bsv).length), bufsv_data(bsv)
 
-#define bufsv_to_sv(bsv) nob_sv_from_parts((bsv).buffer->items + (bsv).index, (bsv).length)
+#define bufsv_is_mapped(bsv) ((bsv).index < mori.mapped_size)
+#define bufsv_data(bsv) (mori.mapped_size && (bsv).index >= mori.mapped_size   \
+                         ? mori.overlay.items + ((bsv).index - mori.mapped_size) \
+                         : mori.buffer.items + (bsv).index)
+#define bufsv_to_sv(bsv) nob_sv_from_parts(bufsv_data(bsv), (bsv).length)
 
 typedef struct {
   Buffered_String_View name;
@@ -65,348 +71,2635 @@ typedef struct {
   };
 } Mori_Tree;
 
+_Static_assert(sizeof(Mori_Tree) == 24, "Mori_Tree should stay compact");
+
+// Free byte ranges of the forest buffer, see the string heap below
 typedef struct {
-  Nob_String_Builder buffer;
+  size_t index;
+  size_t length;
+} Mori_Heap_Range;
+
+typedef struct {
+  Mori_Heap_Range *items;
+  size_t count;
+  size_t capacity;
+} Mori_Heap_Ranges;
 
+#define MORI_HEAP_SIZE_CLASSES 32
+
+typedef struct {
+  Nob_String_Builder buffer;
+  // Non-zero while `buffer` is a read-only mapping of the morimori file
+  size_t mapped_size;
+  // Strings allocated while `buffer` is mapped, their offsets start at `mapped_size`
+  Nob_String_Builder overlay;
+  // Bytes of `buffer` still referenced by a tree, see the string heap below
+  size_t heap_live;
+  Mori_Heap_Ranges free_lists[MORI_HEAP_SIZE_CLASSES];
+  // Format version and snapshot the forest was loaded from, journals only apply to their own snapshot
+  byte_t version;
+  uint64_t snapshot_id;
+  // Set once every tree has its folded name, see the folded names below
+  bool folded_ready;
+  // Moves on with every edit of the forest, see the query result cache below
+  uint64_t generation;
+
+#ifdef MORI_COLUMNAR
+  // Struct-of-arrays layout, numeric scans only touch the column they need
+  Buffered_String_View *names;
+  Buffered_String_View *urls;
+  uint32_t *chapters;
+  uint32_t *volumes;
+#else
   Mori_Tree *items;
+#endif // MORI_COLUMNAR
+  // Case folded copy of every name, only search looks at it so it's kept apart in either layout
+  Buffered_String_View *folded;
   size_t count;
   size_t capacity;
 } Mori_Mori;
 
+// Field accessors of tree `i`, they're lvalues in either layout of the forest
+#ifdef MORI_COLUMNAR
+#  define mori_name(i)    (mori.names[i])
+#  define mori_url(i)     (mori.urls[i])
+#  define mori_chapter(i) (mori.chapters[i])
+#  define mori_volume(i)  (mori.volumes[i])
+#else
+#  define mori_name(i)    (mori.items[i].name)
+#  define mori_url(i)     (mori.items[i].url)
+#  define mori_chapter(i) (mori.items[i].chapter)
+#  define mori_volume(i)  (mori.items[i].volume)
+#endif // MORI_COLUMNAR
+#define mori_folded(i) (mori.folded[i])
+
 #define MORI_HEADER_SIZE 6
 const byte_t mori_header[MORI_HEADER_SIZE] = { 'M', 'O', 'R', 'I', 69, MORI_VERSION };
 
+// v1 layout:
+//   Mori_V1_Header
+//   Mori_V1_Record[tree_count]  (record_size bytes each, starting at records_offset)
+//   string heap                 (heap_size bytes starting at heap_offset)
+// Record string offsets are relative to the start of the heap. Fields are appended to the end of the
+// header and of the record over time, readers only trust what `header_size` and `record_size` cover.
+typedef struct {
+  byte_t   magic[MORI_HEADER_SIZE];
+  uint16_t header_size;
+  uint32_t tree_count;
+  uint32_t record_size;
+  uint64_t records_offset;
+  uint64_t heap_offset;
+  uint64_t heap_size;
+  // Bumped on every full rewrite of the file, see the journal below
+  uint64_t snapshot_id;
+  // MORI_FOLD_VERSION the folded names of the records were made with, 0 when they weren't saved
+  uint32_t fold_version;
+  uint32_t reserved;
+} Mori_V1_Header;
+
+// Size of the very first v1 header, anything a file has beyond it is optional
+#define MORI_V1_MIN_HEADER_SIZE offsetof(Mori_V1_Header, snapshot_id)
+
+typedef struct {
+  uint32_t name_offset;
+  uint32_t name_length;
+  uint32_t url_offset;
+  uint32_t url_length;
+  uint32_t chapter;
+  uint32_t volume;
+  // Only there when the file was saved with MORI_PERSIST_FOLDED_NAMES
+  uint32_t folded_offset;
+  uint32_t folded_length;
+} Mori_V1_Record;
+
+// Size of the very first v1 record
+#define MORI_V1_MIN_RECORD_SIZE offsetof(Mori_V1_Record, folded_offset)
+
+_Static_assert(sizeof(Mori_V1_Header) == 56, "Mori_V1_Header must not have padding");
+_Static_assert(sizeof(Mori_V1_Record) == 32, "Mori_V1_Record must not have padding");
+
 Mori_Mori mori = {0};
 
+void mori_reserve(size_t capacity) {
+  if (capacity <= mori.capacity) return;
+  size_t new_capacity = mori.capacity ? mori.capacity : NOB_DA_INIT_CAP;
+  while (new_capacity < capacity) new_capacity *= 2;
+#ifdef MORI_COLUMNAR
+  mori.names    = NOB_REALLOC(mori.names,    new_capacity*sizeof(*mori.names));
+  mori.urls     = NOB_REALLOC(mori.urls,     new_capacity*sizeof(*mori.urls));
+  mori.chapters = NOB_REALLOC(mori.chapters, new_capacity*sizeof(*mori.chapters));
+  mori.volumes  = NOB_REALLOC(mori.volumes,  new_capacity*sizeof(*mori.volumes));
+  NOB_ASSERT(mori.names && mori.urls && mori.chapters && mori.volumes && "Buy more RAM lol");
+#else
+  mori.items = NOB_REALLOC(mori.items, new_capacity*sizeof(*mori.items));
+  NOB_ASSERT(mori.items != NULL && "Buy more RAM lol");
+#endif // MORI_COLUMNAR
+  mori.folded = NOB_REALLOC(mori.folded, new_capacity*sizeof(*mori.folded));
+  NOB_ASSERT(mori.folded != NULL && "Buy more RAM lol");
+  mori.capacity = new_capacity;
+}
+
+Mori_Tree mori_get(size_t i) {
+  return (Mori_Tree) {
+    .name = mori_name(i),
+    .url = mori_url(i),
+    .chapter = mori_chapter(i),
+    .volume = mori_volume(i),
+  };
+}
+
+void mori_set(size_t i, Mori_Tree tree) {
+  mori_name(i) = tree.name;
+  mori_url(i) = tree.url;
+  mori_chapter(i) = tree.chapter;
+  mori_volume(i) = tree.volume;
+}
+
+void mori_refold(size_t i);
+void mori_orders_insert(size_t i);
+void mori_orders_remove(size_t i, bool deleted);
+void mori_exact_add(size_t i);
+void mori_exact_remove(size_t i, bool deleted);
+
+void mori_append(Mori_Tree tree) {
+  mori_reserve(mori.count + 1);
+  mori_folded(mori.count) = (Buffered_String_View) {0};
+  mori_set(mori.count++, tree);
+  mori_refold(mori.count - 1);
+  mori_orders_insert(mori.count - 1);
+  mori_exact_add(mori.count - 1);
+}
+
+void mori_remove(size_t index) {
+  if (index >= mori.count) return;
+  size_t moved = mori.count - index - 1;
+#ifdef MORI_COLUMNAR
+  memmove(mori.names + index,    mori.names + index + 1,    moved*sizeof(*mori.names));
+  memmove(mori.urls + index,     mori.urls + index + 1,     moved*sizeof(*mori.urls));
+  memmove(mori.chapters + index, mori.chapters + index + 1, moved*sizeof(*mori.chapters));
+  memmove(mori.volumes + index,  mori.volumes + index + 1,  moved*sizeof(*mori.volumes));
+#else
+  memmove(mori.items + index, mori.items + index + 1, moved*sizeof(*mori.items));
+#endif // MORI_COLUMNAR
+  memmove(mori.folded + index, mori.folded + index + 1, moved*sizeof(*mori.folded));
+  mori.count--;
+}
+
+void mori_free_trees() {
+#ifdef MORI_COLUMNAR
+  NOB_FREE(mori.names);
+  NOB_FREE(mori.urls);
+  NOB_FREE(mori.chapters);
+  NOB_FREE(mori.volumes);
+#else
+  NOB_FREE(mori.items);
+#endif // MORI_COLUMNAR
+  NOB_FREE(mori.folded);
+  mori.folded_ready = false;
+  mori.count = 0;
+  mori.capacity = 0;
+}
+
 const char *get_morimori_file_path() {
   const char *home_path = getenv("HOME");
   return nob_temp_sprintf("%s/.config/%s", home_path, MORI_FILE_NAME);
 }
 
-bool get_v0_mori_tree_from_bytes(String_Builder *buffer, size_t *offset, Mori_Tree *tree, bool *errored) {
-  *errored = false;
-  if (*offset > buffer->count) {
-    nob_log(ERROR, "Internal Error: Attempting to reach outside of the allocated buffer");
-    *errored = true;
-    return false;
+// String heap:
+// Every name and url is a view into mori.buffer. Edits and deletes leave their old bytes behind, `heap_live`
+// counts the bytes still referenced so everything else in the buffer is garbage for mori_compact_heap().
+// Released ranges go into a free list per power of two size class (class k holds lengths in [2^k, 2^(k+1)))
+// so later strings reuse them before the buffer grows. A mapped buffer is never written to, new strings go
+// to mori.overlay and released bytes of the mapping stay garbage until compaction copies the heap out.
+#ifndef MORI_HEAP_GARBAGE_RATIO
+#define MORI_HEAP_GARBAGE_RATIO 0.5
+#endif // MORI_HEAP_GARBAGE_RATIO
+
+// Released ranges shorter than this are left as garbage for compaction instead of cluttering the free lists
+#ifndef MORI_HEAP_MIN_FREE_RANGE
+#define MORI_HEAP_MIN_FREE_RANGE 8
+#endif // MORI_HEAP_MIN_FREE_RANGE
+
+// Below this size the buffer is never worth compacting
+#ifndef MORI_HEAP_COMPACT_MIN_SIZE
+#define MORI_HEAP_COMPACT_MIN_SIZE (64*1024)
+#endif // MORI_HEAP_COMPACT_MIN_SIZE
+
+// Bytes of the heap across the buffer and the overlay
+size_t mori_heap_size() {
+  return mori.buffer.count + mori.overlay.count;
+}
+
+void mori_recount_heap_live() {
+  mori.heap_live = 0;
+  for (size_t i = 0; i < mori.count; ++i) mori.heap_live += mori_name(i).length + mori_url(i).length;
+  if (!mori.folded_ready) return;
+  for (size_t i = 0; i < mori.count; ++i) mori.heap_live += mori_folded(i).length;
+}
+
+size_t mori_heap_size_class(size_t length) {
+  size_t k = 0;
+  while (k + 1 < MORI_HEAP_SIZE_CLASSES && ((size_t)2 << k) <= length) k++;
+  return k;
+}
+
+void mori_heap_free_range(size_t index, size_t length) {
+  if (length < MORI_HEAP_MIN_FREE_RANGE || index < mori.mapped_size) return;
+  Mori_Heap_Range range = { .index = index, .length = length };
+  da_append(&mori.free_lists[mori_heap_size_class(length)], range);
+}
+
+void mori_heap_clear_free_lists() {
+  for (size_t k = 0; k < MORI_HEAP_SIZE_CLASSES; ++k) mori.free_lists[k].count = 0;
+}
+
+// Takes `length` bytes out of a free range if any is big enough. The own class of `length` may hold ranges
+// too short for it so it's searched from the back, every class above it fits by construction.
+bool mori_heap_take_free_range(size_t length, size_t *index) {
+  size_t k = mori_heap_size_class(length);
+  Mori_Heap_Ranges *list = &mori.free_lists[k];
+  Mori_Heap_Range range = {0};
+  bool found = false;
+  for (size_t i = list->count; i > 0; --i) {
+    if (list->items[i - 1].length < length) continue;
+    range = list->items[i - 1];
+    list->items[i - 1] = list->items[--list->count];
+    found = true;
+    break;
   }
-  size_t bytes_len = buffer->count - (*offset);
-  if (bytes_len == 0) return false;
-  // nob_log(INFO, "Reading leftover bytes: %zu", bytes_len);
-  if (bytes_len == 1) {
-    char b = buffer->items[*offset];
-    nob_log(INFO, "Hit a single byte: %d -> '%c'", b, b);
-    if (b == '\n') {
-      buffer->count--;
-      return false;
-    }
+  for (k = k + 1; !found && k < MORI_HEAP_SIZE_CLASSES; ++k) {
+    list = &mori.free_lists[k];
+    if (list->count == 0) continue;
+    range = list->items[--list->count];
+    found = true;
   }
+  if (!found) return false;
 
-  union {
-    char buf[sizeof(uint32_t)];
-    uint32_t val;
-  } num;
-  num.val = 0;
-
-  for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-    if (bytes_len == 0) {
-      nob_log(ERROR, "Malformed Mori Tree: Expected name length as a ui32 at the start of a mori_tree");
-      *errored = true;
-      return false;
-    }
-    num.buf[i] = buffer->items[(*offset) + i];
-    bytes_len--;
+  *index = range.index;
+  mori_heap_free_range(range.index + length, range.length - length);
+  return true;
+}
+
+// Hands out `length` uninitialized bytes of the heap. The buffer may move so views have to be resolved
+// with bufsv_data() again afterwards, an empty view is returned once the buffer is full.
+Buffered_String_View mori_heap_alloc(size_t length) {
+  if (length == 0) return (Buffered_String_View) {0};
+  Buffered_String_View bsv = { .index = (uint32_t)mori_heap_size(), .length = (uint32_t)length };
+
+  size_t index = 0;
+  String_Builder *region = mori.mapped_size ? &mori.overlay : &mori.buffer;
+  if (mori_heap_take_free_range(length, &index)) {
+    bsv.index = (uint32_t)index;
+  } else if (mori_heap_size() + length > UINT32_MAX) {
+    return (Buffered_String_View) {0};
+  } else {
+    da_reserve(region, region->count + length);
+    region->count += length;
+  }
+  mori.heap_live += length;
+  return bsv;
+}
+
+Buffered_String_View mori_heap_push(String_View sv) {
+  Buffered_String_View bsv = mori_heap_alloc(sv.count);
+  if (bsv.length != sv.count) {
+    nob_log(ERROR, "Your 森 has outgrown its 4GiB buffer, dropping '"SV_Fmt"'", SV_Arg(sv));
+    return bsv;
   }
-  memmove(buffer->items + (*offset), buffer->items + (*offset + sizeof(uint32_t)), bytes_len);
-  buffer->count -= sizeof(uint32_t);
+  if (sv.count) memcpy(bufsv_data(bsv), sv.data, sv.count);
+  return bsv;
+}
 
-  uint32_t name_len = num.val;
-  if (bytes_len == 0 || bytes_len < name_len) {
-    nob_log(ERROR, "Malformed Mori Tree: Not enough data exists in file to read name");
-    *errored = true;
-    return false;
+void mori_heap_release(Buffered_String_View *bsv) {
+  mori_heap_free_range(bsv->index, bsv->length);
+  mori.heap_live -= bsv->length;
+  bsv->length = 0;
+}
+
+// Gives the bytes of `bsv` past `length` back to the heap
+void mori_heap_shrink(Buffered_String_View *bsv, size_t length) {
+  if (length >= bsv->length) return;
+  mori_heap_free_range(bsv->index + length, bsv->length - length);
+  mori.heap_live -= bsv->length - length;
+  bsv->length = (uint32_t)length;
+}
+
+// Replaces the contents of `bsv`, in place when the new string fits in the old bytes and they aren't mapped
+void mori_heap_set(Buffered_String_View *bsv, String_View sv) {
+  if (sv.count <= bsv->length && !bufsv_is_mapped(*bsv)) {
+    if (sv.count) memcpy(bufsv_data(*bsv), sv.data, sv.count);
+    mori_heap_shrink(bsv, sv.count);
+    return;
   }
-  if (name_len == 0) return false;
-  tree->name = (Buffered_String_View) { .buffer = buffer, .index = *offset, .length = (size_t)name_len };
-  *offset += name_len;
-  bytes_len -= name_len;
-  nob_log(INFO, "Loading manga: '"BufSV_Fmt"'...", BufSV_Arg(tree->name));
-
-  num.val = 0;
-  for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-    if (bytes_len == 0) {
-      nob_log(ERROR, "Malformed Mori Tree: Expected url length as a ui32 after name");
-      *errored = true;
-      return false;
+
+  mori_heap_release(bsv);
+  *bsv = mori_heap_push(sv);
+}
+
+// Trigram index:
+// Maps every 3 byte sequence of the folded names to the sorted indices of the trees containing it. A search
+// only verifies the trees found in all posting lists of the query instead of scanning the whole forest.
+// It's built for the interactive session and kept up to date from mori_refold() and mori_delete_tree().
+typedef struct {
+  uint32_t *items;
+  size_t count;
+  size_t capacity;
+} Mori_Postings;
+
+typedef struct {
+  // Trigram + 1 per slot so 0 marks an empty one, open addressing with linear probing
+  uint32_t *keys;
+  Mori_Postings *postings;
+  size_t count;
+  size_t capacity;
+  bool ready;
+} Mori_Trigram_Index;
+
+Mori_Trigram_Index trigrams = {0};
+
+#define mori_trigram_at(data, k) \
+  (((uint32_t)(byte_t)(data)[k] << 16 | (uint32_t)(byte_t)(data)[(k) + 1] << 8 | (uint32_t)(byte_t)(data)[(k) + 2]) + 1)
+
+size_t mori_trigram_slot(uint32_t key) {
+  size_t mask = trigrams.capacity - 1;
+  size_t slot = (size_t)(key*2654435761u) & mask;
+  while (trigrams.keys[slot] && trigrams.keys[slot] != key) slot = (slot + 1) & mask;
+  return slot;
+}
+
+Mori_Postings *mori_trigram_find(uint32_t key) {
+  if (trigrams.capacity == 0) return NULL;
+  size_t slot = mori_trigram_slot(key);
+  return trigrams.keys[slot] ? &trigrams.postings[slot] : NULL;
+}
+
+Mori_Postings *mori_trigram_get_or_insert(uint32_t key) {
+  if (2*(trigrams.count + 1) > trigrams.capacity) {
+    Mori_Trigram_Index old = trigrams;
+    trigrams.capacity = old.capacity ? 2*old.capacity : 1024;
+    trigrams.keys = calloc(trigrams.capacity, sizeof(*trigrams.keys));
+    trigrams.postings = calloc(trigrams.capacity, sizeof(*trigrams.postings));
+    NOB_ASSERT(trigrams.keys && trigrams.postings && "Buy more RAM lol");
+    for (size_t i = 0; i < old.capacity; ++i) {
+      if (!old.keys[i]) continue;
+      size_t slot = mori_trigram_slot(old.keys[i]);
+      trigrams.keys[slot] = old.keys[i];
+      trigrams.postings[slot] = old.postings[i];
     }
-    num.buf[i] = buffer->items[(*offset) + i];
-    bytes_len--;
+    free(old.keys);
+    free(old.postings);
   }
-  memmove(buffer->items + (*offset), buffer->items + (*offset + sizeof(uint32_t)), bytes_len);
-  buffer->count -= sizeof(uint32_t);
 
-  uint32_t url_len = num.val;
-  if (bytes_len == 0 || bytes_len < name_len) {
-    nob_log(ERROR, "Malformed Mori Tree: Not enough data exists in file to read url");
-    *errored = true;
-    return false;
+  size_t slot = mori_trigram_slot(key);
+  if (!trigrams.keys[slot]) {
+    trigrams.keys[slot] = key;
+    trigrams.count++;
   }
-  tree->url = (Buffered_String_View) { .buffer = buffer, .index = *offset, .length = (size_t)url_len };
-  *offset += url_len;
-  bytes_len -= url_len;
+  return &trigrams.postings[slot];
+}
 
+// First position in the posting list whose tree index is not below `index`
+size_t mori_postings_lower_bound(const Mori_Postings *postings, size_t from, uint32_t index) {
+  size_t lo = from, hi = postings->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (postings->items[mid] < index) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-  num.val = 0;
-  for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-    if (bytes_len == 0) {
-      nob_log(ERROR, "Malformed Mori Tree: Expected chapters count as a ui32 after url");
-      *errored = true;
-      return false;
-    }
-    num.buf[i] = buffer->items[(*offset) + i];
-    bytes_len--;
+void mori_trigram_add(size_t index, String_View folded) {
+  for (size_t k = 0; k + 3 <= folded.count; ++k) {
+    Mori_Postings *postings = mori_trigram_get_or_insert(mori_trigram_at(folded.data, k));
+    size_t at = mori_postings_lower_bound(postings, 0, (uint32_t)index);
+    if (at < postings->count && postings->items[at] == index) continue;
+    da_reserve(postings, postings->count + 1);
+    memmove(postings->items + at + 1, postings->items + at, (postings->count - at)*sizeof(*postings->items));
+    postings->items[at] = (uint32_t)index;
+    postings->count++;
   }
-  memmove(buffer->items + (*offset), buffer->items + (*offset + sizeof(uint32_t)), bytes_len);
-  buffer->count -= sizeof(uint32_t);
+}
 
-  uint32_t chapters_count = num.val;
-  tree->chapter = chapters_count;
-  nob_log(INFO, "    Chapter: %u", tree->chapter);
+void mori_trigram_remove(size_t index, String_View folded) {
+  for (size_t k = 0; k + 3 <= folded.count; ++k) {
+    Mori_Postings *postings = mori_trigram_find(mori_trigram_at(folded.data, k));
+    if (!postings) continue;
+    size_t at = mori_postings_lower_bound(postings, 0, (uint32_t)index);
+    if (at == postings->count || postings->items[at] != index) continue;
+    memmove(postings->items + at, postings->items + at + 1, (postings->count - at - 1)*sizeof(*postings->items));
+    postings->count--;
+  }
+}
 
-  num.val = 0;
-  for (size_t i = 0; i < sizeof(uint32_t); ++i) {
-    if (bytes_len == 0) {
-      nob_log(ERROR, "Malformed Mori Tree: Expected volumes count as a ui32 after chapters");
-      *errored = true;
-      return false;
+// Every tree after a removed one moves down by one
+void mori_trigram_shift_down(size_t removed_index) {
+  for (size_t slot = 0; slot < trigrams.capacity; ++slot) {
+    Mori_Postings *postings = &trigrams.postings[slot];
+    for (size_t at = mori_postings_lower_bound(postings, 0, (uint32_t)removed_index); at < postings->count; ++at) {
+      postings->items[at]--;
     }
-    num.buf[i] = buffer->items[(*offset) + i];
-    bytes_len--;
   }
-  memmove(buffer->items + (*offset), buffer->items + (*offset + sizeof(uint32_t)), bytes_len);
-  buffer->count -= sizeof(uint32_t);
+}
 
-  uint32_t volumes_count = num.val;
-  tree->volume = volumes_count;
-  nob_log(INFO, "    Volume: %u", tree->volume);
+void mori_trigram_free() {
+  for (size_t slot = 0; slot < trigrams.capacity; ++slot) free(trigrams.postings[slot].items);
+  free(trigrams.keys);
+  free(trigrams.postings);
+  memset(&trigrams, 0, sizeof(trigrams));
+}
 
-  return true;
+// Prefix index:
+// Every word start of every folded name, sorted by the rest of the name from there on. All the names with a
+// word starting with some prefix are then one contiguous range found by two binary searches, which is what
+// search-as-you-type runs per keystroke. Entries only hold the tree and the offset of the word in its folded
+// name, so they survive the heap being compacted. Kept up to date like the trigram index.
+typedef struct {
+  uint32_t tree;
+  uint32_t offset;
+} Mori_Prefix_Entry;
+
+typedef struct {
+  Mori_Prefix_Entry *items;
+  size_t count;
+  size_t capacity;
+  bool ready;
+} Mori_Prefix_Index;
+
+Mori_Prefix_Index prefixes = {0};
+
+// Bytes that end a word, anything non ascii counts as part of one
+bool mori_is_word_separator(char c) {
+  byte_t b = (byte_t)c;
+  return b < 0x80 && !(('a' <= b && b <= 'z') || ('A' <= b && b <= 'Z') || ('0' <= b && b <= '9'));
 }
 
-bool read_morimori_file(String_Builder *sb, const char *morimori_file_path) {
-  nob_log(INFO, "Reading morimori file...");
-  sb->count = 0;
-  if (!read_entire_file(morimori_file_path, sb)) {
-    nob_log(WARNING, "Failed to read morimori file! Data in it will be ignored");
-    return false;
+bool mori_is_word_start(String_View folded, size_t k) {
+  if (mori_is_word_separator(folded.data[k])) return false;
+  return k == 0 || mori_is_word_separator(folded.data[k - 1]);
+}
+
+String_View mori_prefix_suffix(Mori_Prefix_Entry entry) {
+  String_View folded = bufsv_to_sv(mori_folded(entry.tree));
+  return sv_from_parts(folded.data + entry.offset, folded.count - entry.offset);
+}
+
+int mori_prefix_compare(Mori_Prefix_Entry a, Mori_Prefix_Entry b) {
+  String_View x = mori_prefix_suffix(a), y = mori_prefix_suffix(b);
+  int cmp = memcmp(x.data, y.data, x.count < y.count ? x.count : y.count);
+  if (cmp != 0) return cmp;
+  if (x.count != y.count) return x.count < y.count ? -1 : 1;
+  if (a.tree != b.tree) return a.tree < b.tree ? -1 : 1;
+  if (a.offset != b.offset) return a.offset < b.offset ? -1 : 1;
+  return 0;
+}
+
+int mori_prefix_qsort_compare(const void *a, const void *b) {
+  return mori_prefix_compare(*(const Mori_Prefix_Entry*)a, *(const Mori_Prefix_Entry*)b);
+}
+
+size_t mori_prefix_lower_bound(Mori_Prefix_Entry entry) {
+  size_t lo = 0, hi = prefixes.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (mori_prefix_compare(prefixes.items[mid], entry) < 0) lo = mid + 1;
+    else hi = mid;
   }
-  nob_log(INFO, "Bytes read: %zu", sb->count);
+  return lo;
+}
 
-  if (sb->count < MORI_HEADER_SIZE) {
-    nob_log(ERROR, "morimori file is missing header");
-    return false;
+void mori_prefix_add(size_t index, String_View folded) {
+  for (size_t k = 0; k < folded.count; ++k) {
+    if (!mori_is_word_start(folded, k)) continue;
+    Mori_Prefix_Entry entry = { .tree = (uint32_t)index, .offset = (uint32_t)k };
+    size_t at = mori_prefix_lower_bound(entry);
+    da_reserve(&prefixes, prefixes.count + 1);
+    memmove(prefixes.items + at + 1, prefixes.items + at, (prefixes.count - at)*sizeof(*prefixes.items));
+    prefixes.items[at] = entry;
+    prefixes.count++;
   }
+}
 
-  for (size_t i = 0; i < MORI_HEADER_SIZE - 1; ++i) {
-    byte_t b = sb->items[i];
-    if (b != mori_header[i]) {
-      nob_log(ERROR, "Invalid morimori header");
-      return false;
-    }
+// `folded` has to still be the folded name the entries of the tree were sorted by
+void mori_prefix_remove(size_t index, String_View folded) {
+  for (size_t k = 0; k < folded.count; ++k) {
+    if (!mori_is_word_start(folded, k)) continue;
+    Mori_Prefix_Entry entry = { .tree = (uint32_t)index, .offset = (uint32_t)k };
+    size_t at = mori_prefix_lower_bound(entry);
+    if (at == prefixes.count || prefixes.items[at].tree != entry.tree || prefixes.items[at].offset != entry.offset) continue;
+    memmove(prefixes.items + at, prefixes.items + at + 1, (prefixes.count - at - 1)*sizeof(*prefixes.items));
+    prefixes.count--;
   }
+}
 
-  byte_t v = *(sb->items + (MORI_HEADER_SIZE - 1));
-  if (v > MORI_VERSION) {
-    nob_log(ERROR, "Invalid version in header");
-    return false;
+// Decrementing keeps the order, trees only ever break ties between equal suffixes
+void mori_prefix_shift_down(size_t removed_index) {
+  for (size_t at = 0; at < prefixes.count; ++at) {
+    if (prefixes.items[at].tree > removed_index) prefixes.items[at].tree--;
   }
+}
 
-  memmove(sb->items, sb->items + MORI_HEADER_SIZE, sb->count - MORI_HEADER_SIZE);
-  sb->count -= MORI_HEADER_SIZE;
-  size_t offset = 0;
+// Compares the start of the entry's suffix to `prefix`, 0 when the suffix starts with it
+int mori_prefix_compare_to(Mori_Prefix_Entry entry, String_View prefix) {
+  String_View suffix = mori_prefix_suffix(entry);
+  int cmp = memcmp(suffix.data, prefix.data, suffix.count < prefix.count ? suffix.count : prefix.count);
+  if (cmp != 0) return cmp;
+  return suffix.count < prefix.count ? -1 : 0;
+}
 
-  switch (v) {
-  case 0:
-    nob_log(INFO, "Loading morimori v0...");
-    while (sb->count - offset) {
-      Mori_Tree tree = {0};
-      bool errored = false;
-      if (!get_v0_mori_tree_from_bytes(sb, &offset, &tree, &errored)) {
-	if (errored) nob_log(NOB_ERROR, "Failed to read v0 mori tree bytes");
-	return !errored;
+int mori_u32_compare(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// Puts the indices of the trees with a word starting with the folded `prefix` in ntemp, in order
+size_t mori_prefix_lookup(String_View prefix, uint32_t **matches) {
+  size_t lo = 0, hi = prefixes.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (mori_prefix_compare_to(prefixes.items[mid], prefix) < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  size_t first = lo;
+  hi = prefixes.count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo)/2;
+    if (mori_prefix_compare_to(prefixes.items[mid], prefix) <= 0) lo = mid + 1;
+    else hi = mid;
+  }
+
+  size_t count = lo - first;
+  *matches = ntemp_alloc((count ? count : 1)*sizeof(**matches));
+  for (size_t i = 0; i < count; ++i) (*matches)[i] = prefixes.items[first + i].tree;
+  qsort(*matches, count, sizeof(**matches), mori_u32_compare);
+
+  size_t unique = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (unique == 0 || (*matches)[unique - 1] != (*matches)[i]) (*matches)[unique++] = (*matches)[i];
+  }
+  return unique;
+}
+
+void mori_prefix_free() {
+  free(prefixes.items);
+  memset(&prefixes, 0, sizeof(prefixes));
+}
+
+// Folded names:
+// Search matches the query against a case folded copy of every name instead of folding names per query.
+// The copies live in the string heap next to the names, mori_fold_names() builds them once for the forest
+// and from then on mori_refold() keeps tree `i` up to date whenever its name changes. Files saved with
+// MORI_PERSIST_FOLDED_NAMES carry them too, they're only trusted when made with the same MORI_FOLD_VERSION.
+//
+// Folding goes through the tables nob.c generates (see mori_fold_table.h): it drops case, turns fullwidth
+// ascii into ascii and all katakana, halfwidth included, into hiragana. Folded text is never longer.
+#define MORI_FOLD_VERSION 2
+
+size_t utf8_encode(uint32_t cp, char *dest) {
+  if (cp < 0x80) {
+    dest[0] = (char)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    dest[0] = (char)(0xC0 | cp >> 6);
+    dest[1] = (char)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  dest[0] = (char)(0xE0 | cp >> 12);
+  dest[1] = (char)(0x80 | (cp >> 6 & 0x3F));
+  dest[2] = (char)(0x80 | (cp & 0x3F));
+  return 3;
+}
+
+// Folds `length` bytes of utf-8 into `dest`, which needs as many, and returns the folded length. Bytes that
+// aren't valid utf-8 and code points past the BMP are copied as they are.
+size_t mori_fold_utf8(const char *src, size_t length, char *dest) {
+  size_t out = 0;
+  // Where the last code point written starts, for the sound marks to compose with
+  uint32_t last_cp = 0;
+  size_t last_at = 0;
+  for (size_t i = 0; i < length;) {
+    byte_t b = (byte_t)src[i];
+    uint32_t cp = 0;
+    size_t size = 0;
+    if (b < 0x80) {
+      cp = b, size = 1;
+    } else if ((b & 0xE0) == 0xC0 && i + 1 < length && ((byte_t)src[i + 1] & 0xC0) == 0x80) {
+      cp = (uint32_t)(b & 0x1F) << 6 | ((byte_t)src[i + 1] & 0x3F), size = 2;
+    } else if ((b & 0xF0) == 0xE0 && i + 2 < length && ((byte_t)src[i + 1] & 0xC0) == 0x80 && ((byte_t)src[i + 2] & 0xC0) == 0x80) {
+      cp = (uint32_t)(b & 0x0F) << 12 | (uint32_t)((byte_t)src[i + 1] & 0x3F) << 6 | ((byte_t)src[i + 2] & 0x3F), size = 3;
+    }
+    // Overlong encodings are left alone like any other invalid utf-8
+    if (size == 0 || (size == 2 && cp < 0x80) || (size == 3 && cp < 0x800)) {
+      dest[out++] = src[i++];
+      last_cp = 0;
+      continue;
+    }
+    i += size;
+
+    cp = (uint32_t)((int32_t)cp + mori_fold_pages[mori_fold_page_index[cp >> 8]][cp & 0xFF]);
+    if ((cp == 0x3099 || cp == 0x309A) && 0x3040 <= last_cp && last_cp < 0x30A0) {
+      uint16_t composed = (cp == 0x3099 ? mori_fold_voiced : mori_fold_semi_voiced)[last_cp - 0x3040];
+      if (composed) {
+        out = last_at + utf8_encode(composed, dest + last_at);
+        last_cp = 0;
+        continue;
       }
-      if (tree.name.length) da_append(&mori, tree);
     }
+    last_cp = cp;
+    last_at = out;
+    out += utf8_encode(cp, dest + out);
+  }
+  return out;
+}
+
+String_View ntemp_sv_fold(String_View sv) {
+  char *dest = ntemp_alloc(sv.count + 1);
+  size_t length = mori_fold_utf8(sv.data, sv.count, dest);
+  dest[length] = 0;
+  return sv_from_parts(dest, length);
+}
+
+#ifndef MORI_PERSIST_FOLDED_NAMES
+#define MORI_PERSIST_FOLDED_NAMES 1
+#endif // MORI_PERSIST_FOLDED_NAMES
+
+void mori_refold(size_t i) {
+  if (!mori.folded_ready) return;
+  if (trigrams.ready) mori_trigram_remove(i, bufsv_to_sv(mori_folded(i)));
+  if (prefixes.ready) mori_prefix_remove(i, bufsv_to_sv(mori_folded(i)));
+  mori_heap_release(&mori_folded(i));
+  Buffered_String_View folded = mori_heap_alloc(mori_name(i).length);
+  if (folded.length == mori_name(i).length) {
+    mori_heap_shrink(&folded, mori_fold_utf8(bufsv_data(mori_name(i)), folded.length, bufsv_data(folded)));
+  }
+  mori_folded(i) = folded;
+  if (trigrams.ready) mori_trigram_add(i, bufsv_to_sv(folded));
+  if (prefixes.ready) mori_prefix_add(i, bufsv_to_sv(folded));
+}
+
+void mori_fold_names() {
+  if (mori.folded_ready) return;
+  mori.folded_ready = true;
+  for (size_t i = 0; i < mori.count; ++i) {
+    mori_folded(i) = (Buffered_String_View) {0};
+    mori_refold(i);
+  }
+}
+
+void mori_trigram_build() {
+  if (trigrams.ready) return;
+  uint64_t start = nob_nanos_since_unspecified_epoch();
+  mori_fold_names();
+  for (size_t i = 0; i < mori.count; ++i) mori_trigram_add(i, bufsv_to_sv(mori_folded(i)));
+  trigrams.ready = true;
+  nob_log(INFO, "Indexed %zu trigrams of %zu trees in %.3fms", trigrams.count, mori.count,
+          (double)(nob_nanos_since_unspecified_epoch() - start)/1e6);
+}
+
+void mori_prefix_build() {
+  if (prefixes.ready) return;
+  uint64_t start = nob_nanos_since_unspecified_epoch();
+  mori_fold_names();
+  for (size_t i = 0; i < mori.count; ++i) {
+    String_View folded = bufsv_to_sv(mori_folded(i));
+    for (size_t k = 0; k < folded.count; ++k) {
+      if (!mori_is_word_start(folded, k)) continue;
+      Mori_Prefix_Entry entry = { .tree = (uint32_t)i, .offset = (uint32_t)k };
+      da_append(&prefixes, entry);
+    }
+  }
+  qsort(prefixes.items, prefixes.count, sizeof(*prefixes.items), mori_prefix_qsort_compare);
+  prefixes.ready = true;
+  nob_log(INFO, "Indexed %zu word starts of %zu trees in %.3fms", prefixes.count, mori.count,
+          (double)(nob_nanos_since_unspecified_epoch() - start)/1e6);
+}
+
+// Releases the strings of tree `i` and takes it out of the forest
+void mori_delete_tree(size_t i) {
+  if (trigrams.ready) {
+    mori_trigram_remove(i, bufsv_to_sv(mori_folded(i)));
+    mori_trigram_shift_down(i);
+  }
+  if (prefixes.ready) {
+    mori_prefix_remove(i, bufsv_to_sv(mori_folded(i)));
+    mori_prefix_shift_down(i);
+  }
+  mori_orders_remove(i, true);
+  mori_exact_remove(i, true);
+  mori_heap_release(&mori_name(i));
+  mori_heap_release(&mori_url(i));
+  if (mori.folded_ready) mori_heap_release(&mori_folded(i));
+  mori_remove(i);
+}
+
+// Puts the indices of the trees whose folded name contains `query` in ntemp, in order, and returns how many
+// there are. `query` has to be folded already. Queries of 3 bytes or more go through the trigram index when
+// it's built, everything else scans the folded names.
+size_t mori_search_names(String_View query, uint32_t **matches) {
+  mori_fold_names();
+  size_t found = 0;
+
+  if (!trigrams.ready || query.count < 3) {
+    *matches = ntemp_alloc(mori.count*sizeof(**matches));
+    for (size_t i = 0; i < mori.count; ++i) {
+      if (sv_includes_sv(bufsv_to_sv(mori_folded(i)), query)) (*matches)[found++] = (uint32_t)i;
+    }
+    return found;
+  }
+
+  // Every trigram of the query has to be in the name, the shortest posting list bounds the candidates
+  size_t lists_count = query.count - 2;
+  Mori_Postings **lists = ntemp_alloc(lists_count*sizeof(*lists));
+  size_t shortest = 0;
+  for (size_t k = 0; k < lists_count; ++k) {
+    lists[k] = mori_trigram_find(mori_trigram_at(query.data, k));
+    if (!lists[k] || lists[k]->count == 0) {
+      *matches = NULL;
+      return 0;
+    }
+    if (lists[k]->count < lists[shortest]->count) shortest = k;
+  }
+
+  *matches = ntemp_alloc(lists[shortest]->count*sizeof(**matches));
+  size_t *cursors = ntemp_alloc(lists_count*sizeof(*cursors));
+  memset(cursors, 0, lists_count*sizeof(*cursors));
+  for (size_t c = 0; c < lists[shortest]->count; ++c) {
+    uint32_t candidate = lists[shortest]->items[c];
+    bool in_all = true;
+    for (size_t k = 0; k < lists_count && in_all; ++k) {
+      if (k == shortest) continue;
+      cursors[k] = mori_postings_lower_bound(lists[k], cursors[k], candidate);
+      in_all = cursors[k] < lists[k]->count && lists[k]->items[cursors[k]] == candidate;
+    }
+    if (in_all && sv_includes_sv(bufsv_to_sv(mori_folded(candidate)), query)) (*matches)[found++] = candidate;
+  }
+  return found;
+}
+
+// Sorted views:
+// `list --sort=...` and the 'o' action show the forest ordered by one of its fields. Every order is a
+// permutation of the tree indices, built the first time it's asked for and from then on kept in step with
+// each edit by mori_append(), mori_edited() and mori_delete_tree() instead of being sorted again, ties keep index order. Numbers are sorted with
+// an LSD radix sort. Names are radix sorted on their first 8 folded bytes, a merge sort then settles the
+// runs those bytes can't tell apart.
+typedef enum {
+  MORI_SORT_INDEX,
+  MORI_SORT_NAME,
+  MORI_SORT_CHAPTER,
+  MORI_SORT_VOLUME,
+  MORI_SORT_COUNT,
+} Mori_Sort_Key;
+
+const char *mori_sort_key_names[MORI_SORT_COUNT] = { "index", "name", "chapter", "volume" };
+
+typedef struct {
+  uint32_t *items;
+  size_t count;
+  size_t capacity;
+  bool ready;
+} Mori_Order;
+
+// Index order is the forest itself, its slot is never built
+Mori_Order orders[MORI_SORT_COUNT] = {0};
+
+bool mori_parse_sort_key(const char *name, Mori_Sort_Key *key) {
+  for (size_t k = 0; k < MORI_SORT_COUNT; ++k) {
+    if (strcmp(name, mori_sort_key_names[k]) != 0) continue;
+    *key = (Mori_Sort_Key)k;
     return true;
+  }
+  return false;
+}
 
-  default:
-    nob_log(ERROR, "Unhandled version %d", (int)v);
-    return false;
+// Index breaks ties, so every tree has exactly one place in an order
+int mori_order_compare(Mori_Sort_Key key, uint32_t a, uint32_t b) {
+  int cmp = 0;
+  switch (key) {
+  case MORI_SORT_NAME: {
+    String_View x = bufsv_to_sv(mori_folded(a)), y = bufsv_to_sv(mori_folded(b));
+    size_t common = x.count < y.count ? x.count : y.count;
+    if (common) cmp = memcmp(x.data, y.data, common);
+    if (cmp == 0) cmp = (x.count > y.count) - (x.count < y.count);
+  } break;
+  case MORI_SORT_CHAPTER: cmp = (mori_chapter(a) > mori_chapter(b)) - (mori_chapter(a) < mori_chapter(b)); break;
+  case MORI_SORT_VOLUME:  cmp = (mori_volume(a) > mori_volume(b)) - (mori_volume(a) < mori_volume(b)); break;
+  case MORI_SORT_INDEX:
+  case MORI_SORT_COUNT:   break;
   }
+  if (cmp == 0) cmp = (a > b) - (a < b);
+  return cmp;
 }
 
-// TODO: Write directly to a file instead of throwing everything into the heap before writing everything at once
-bool write_morimori_file(const char *file_path) {
-  Nob_String_Builder content_sb = {0};
-  bool result = true;
+// What the radix sort orders tree `i` by, names by their first 8 folded bytes read big endian
+uint64_t mori_order_radix_key(Mori_Sort_Key key, size_t i) {
+  switch (key) {
+  case MORI_SORT_CHAPTER: return mori_chapter(i);
+  case MORI_SORT_VOLUME:  return mori_volume(i);
+  case MORI_SORT_NAME: {
+    String_View folded = bufsv_to_sv(mori_folded(i));
+    uint64_t radix_key = 0;
+    for (size_t k = 0; k < 8; ++k) radix_key = radix_key << 8 | (k < folded.count ? (byte_t)folded.data[k] : 0);
+    return radix_key;
+  }
+  case MORI_SORT_INDEX:
+  case MORI_SORT_COUNT:   break;
+  }
+  return i;
+}
 
-  sb_append_buf(&content_sb, mori_header, MORI_HEADER_SIZE);
+// Stable LSD radix sort of `items` by `keys`, which is permuted along with it. One histogram pass counts every
+// byte of every key, bytes all keys agree on don't need a pass of their own.
+void mori_radix_sort(uint32_t *items, uint64_t *keys, size_t count, size_t key_bytes) {
+  if (count < 2) return;
+  Ntemp_Checkpoint save_point = ntemp_save();
+  size_t (*histograms)[256] = ntemp_alloc(key_bytes*sizeof(*histograms));
+  memset(histograms, 0, key_bytes*sizeof(*histograms));
+  for (size_t k = 0; k < count; ++k) {
+    for (size_t b = 0; b < key_bytes; ++b) histograms[b][(keys[k] >> (8*b)) & 0xFF] += 1;
+  }
 
-  da_foreach(Mori_Tree, it, &mori) {
-    char *nbytes = NULL;
-    uint32_t value = 0;
+  uint32_t *items_scratch = ntemp_alloc(count*sizeof(*items_scratch));
+  uint64_t *keys_scratch = ntemp_alloc(count*sizeof(*keys_scratch));
+  for (size_t b = 0; b < key_bytes; ++b) {
+    size_t *histogram = histograms[b];
+    if (histogram[(keys[0] >> (8*b)) & 0xFF] == count) continue;
+
+    size_t offset = 0;
+    for (size_t digit = 0; digit < 256; ++digit) {
+      size_t digit_count = histogram[digit];
+      histogram[digit] = offset;
+      offset += digit_count;
+    }
+    for (size_t k = 0; k < count; ++k) {
+      size_t at = histogram[(keys[k] >> (8*b)) & 0xFF]++;
+      items_scratch[at] = items[k];
+      keys_scratch[at] = keys[k];
+    }
+    memcpy(items, items_scratch, count*sizeof(*items));
+    memcpy(keys, keys_scratch, count*sizeof(*keys));
+  }
+  ntemp_rewind(save_point);
+}
 
-    value = (uint32_t)it->name.length;
-    nbytes = (char*)&value;
-    sb_append_buf(&content_sb, nbytes, sizeof(uint32_t));
-    if (it->name.length > 0) sb_append_buf(&content_sb, it->name.buffer->items + it->name.index, it->name.length);
+// Top down merge sort, `scratch` has room for half of `items`
+void mori_merge_sort(Mori_Sort_Key key, uint32_t *items, size_t count, uint32_t *scratch) {
+  if (count < 2) return;
+  size_t half = count/2;
+  mori_merge_sort(key, items, half, scratch);
+  mori_merge_sort(key, items + half, count - half, scratch);
+  if (mori_order_compare(key, items[half - 1], items[half]) < 0) return;
+
+  memcpy(scratch, items, half*sizeof(*items));
+  size_t a = 0, b = half, k = 0;
+  while (a < half && b < count) items[k++] = mori_order_compare(key, items[b], scratch[a]) < 0 ? items[b++] : scratch[a++];
+  while (a < half) items[k++] = scratch[a++];
+}
 
-    value = (uint32_t)it->url.length;
-    nbytes = (char*)&value;
-    sb_append_buf(&content_sb, nbytes, sizeof(uint32_t));
-    if (it->url.length > 0) sb_append_buf(&content_sb, it->url.buffer->items + it->url.index, it->url.length);
+void mori_order_build(Mori_Sort_Key key) {
+  Mori_Order *order = &orders[key];
+  if (key == MORI_SORT_INDEX || order->ready) return;
+  uint64_t start = nob_nanos_since_unspecified_epoch();
+  if (key == MORI_SORT_NAME) mori_fold_names();
 
-    sb_append_buf(&content_sb, it->chapter_bytes, sizeof(uint32_t));
+  Ntemp_Checkpoint save_point = ntemp_save();
+  uint64_t *keys = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(*keys));
+  order->count = 0;
+  da_reserve(order, mori.count);
+  for (size_t i = 0; i < mori.count; ++i) {
+    order->items[order->count++] = (uint32_t)i;
+    keys[i] = mori_order_radix_key(key, i);
+  }
+  mori_radix_sort(order->items, keys, order->count, key == MORI_SORT_NAME ? 8 : 4);
 
-    sb_append_buf(&content_sb, it->volume_bytes, sizeof(uint32_t));
+  if (key == MORI_SORT_NAME) {
+    uint32_t *scratch = ntemp_alloc((order->count/2 + 1)*sizeof(*scratch));
+    for (size_t run = 0, end = 0; run < order->count; run = end) {
+      for (end = run + 1; end < order->count && keys[end] == keys[run]; ++end);
+      mori_merge_sort(key, order->items + run, end - run, scratch);
+    }
   }
+  ntemp_rewind(save_point);
 
-  result = write_entire_file(file_path, content_sb.items, content_sb.count);
+  order->ready = true;
+  nob_log(INFO, "Sorted %zu trees by %s in %.3fms", order->count, mori_sort_key_names[key],
+          (double)(nob_nanos_since_unspecified_epoch() - start)/1e6);
+}
 
-  sb_free(&content_sb);
-  return result;
+// The tree indices in `key` order, NULL for index order
+const uint32_t *mori_order(Mori_Sort_Key key) {
+  if (key == MORI_SORT_INDEX) return NULL;
+  mori_order_build(key);
+  return orders[key].items;
 }
 
-// TODO: Also pass length so the user can go from the end by providing a negative index
-bool read_index_from_stdin(const char *prompt, size_t *value) {
-  const size_t cap = 1024;
-  char buf[cap];
-  int n = 0;
+// Puts tree `i` where it belongs in every built order
+void mori_orders_insert(size_t i) {
+  for (size_t key = 0; key < MORI_SORT_COUNT; ++key) {
+    Mori_Order *order = &orders[key];
+    if (!order->ready) continue;
+    size_t lo = 0, hi = order->count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo)/2;
+      if (mori_order_compare((Mori_Sort_Key)key, order->items[mid], (uint32_t)i) < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    da_reserve(order, order->count + 1);
+    memmove(order->items + lo + 1, order->items + lo, (order->count - lo)*sizeof(*order->items));
+    order->items[lo] = (uint32_t)i;
+    order->count += 1;
+  }
+}
 
-  printf("%s ", prompt);
-  flush();
+// Takes tree `i` out of every built order, and moves the trees after it down by one when it was deleted
+void mori_orders_remove(size_t i, bool deleted) {
+  for (size_t key = 0; key < MORI_SORT_COUNT; ++key) {
+    Mori_Order *order = &orders[key];
+    if (!order->ready) continue;
+    size_t kept = 0;
+    for (size_t k = 0; k < order->count; ++k) {
+      uint32_t tree = order->items[k];
+      if (tree == i) continue;
+      order->items[kept++] = deleted && tree > i ? tree - 1 : tree;
+    }
+    order->count = kept;
+  }
+}
 
-  n = read(STDIN_FILENO, buf, cap);
-  if (n < 0) {
-    nob_log(ERROR, "Read failed: %s", strerror(errno));
-    return false;
+void mori_orders_free() {
+  for (size_t key = 0; key < MORI_SORT_COUNT; ++key) free(orders[key].items);
+  memset(orders, 0, sizeof(orders));
+}
+
+// Brings the indexes up to date with tree `i` after its fields were edited in place, only a new name is refolded
+void mori_edited(size_t i, bool renamed) {
+  if (renamed) mori_refold(i);
+  mori_orders_remove(i, false);
+  mori_orders_insert(i);
+  mori_exact_remove(i, false);
+  mori_exact_add(i);
+}
+
+// Strings zero padded by older versions of the edit action keep their padding, it's dropped when compacting
+String_View bufsv_trim_zero_padding(Buffered_String_View bsv) {
+  String_View sv = bufsv_to_sv(bsv);
+  while (sv.count > 0 && sv.data[sv.count - 1] == 0) sv.count--;
+  return sv;
+}
+
+// Exact index:
+// Folded names and urls hashed into two open addressing tables, so finding the trees with a given name or
+// url doesn't look at every tree. A slot holds a tree with the hash of its key, trees sharing a key take a
+// slot each. A removed slot is filled by shifting the rest of its probe run back, so no tombstones pile up.
+// Like the sorted views it's kept in step with every edit by mori_append(), mori_edited() and mori_delete_tree().
+// Urls ignore ascii case.
+typedef enum {
+  MORI_EXACT_NAME,
+  MORI_EXACT_URL,
+  MORI_EXACT_COUNT,
+} Mori_Exact_Field;
+
+typedef struct {
+  // Tree index + 1 so 0 marks an empty slot
+  uint32_t tree;
+  uint32_t hash;
+} Mori_Exact_Slot;
+
+typedef struct {
+  Mori_Exact_Slot *slots;
+  size_t count;
+  size_t capacity;
+} Mori_Exact_Table;
+
+typedef struct {
+  uint32_t *items;
+  size_t count;
+  size_t capacity;
+} Mori_Exact_Hashes;
+
+typedef struct {
+  Mori_Exact_Table tables[MORI_EXACT_COUNT];
+  // Hash each tree was put in with, its strings may have changed by the time it's taken out
+  Mori_Exact_Hashes hashes[MORI_EXACT_COUNT];
+  bool ready;
+} Mori_Exact_Index;
+
+Mori_Exact_Index exact = {0};
+
+bool sv_eq_ascii_ignore_case(String_View a, String_View b) {
+  if (a.count != b.count) return false;
+  for (size_t i = 0; i < a.count; ++i) {
+    char x = a.data[i], y = b.data[i];
+    if ('A' <= x && x <= 'Z') x += 32;
+    if ('A' <= y && y <= 'Z') y += 32;
+    if (x != y) return false;
+  }
+  return true;
+}
+
+String_View mori_exact_key(Mori_Exact_Field field, size_t i) {
+  return bufsv_trim_zero_padding(field == MORI_EXACT_NAME ? mori_folded(i) : mori_url(i));
+}
+
+// FNV-1a, of the lowercase bytes for urls
+uint32_t mori_exact_hash(Mori_Exact_Field field, String_View key) {
+  uint32_t hash = 2166136261u;
+  for (size_t k = 0; k < key.count; ++k) {
+    byte_t b = (byte_t)key.data[k];
+    if (field == MORI_EXACT_URL && 'A' <= b && b <= 'Z') b += 32;
+    hash = (hash ^ b)*16777619u;
+  }
+  return hash;
+}
+
+bool mori_exact_key_eq(Mori_Exact_Field field, String_View a, String_View b) {
+  return field == MORI_EXACT_NAME ? sv_eq(a, b) : sv_eq_ascii_ignore_case(a, b);
+}
+
+void mori_exact_table_put(Mori_Exact_Table *table, uint32_t tree, uint32_t hash) {
+  // Kept at most half full
+  if ((table->count + 1)*2 > table->capacity) {
+    Mori_Exact_Table grown = { .capacity = table->capacity ? table->capacity*2 : 64 };
+    grown.slots = calloc(grown.capacity, sizeof(*grown.slots));
+    NOB_ASSERT(grown.slots && "Buy more RAM lol");
+    for (size_t s = 0; s < table->capacity; ++s) {
+      if (table->slots[s].tree) mori_exact_table_put(&grown, table->slots[s].tree - 1, table->slots[s].hash);
+    }
+    free(table->slots);
+    *table = grown;
+  }
+
+  size_t mask = table->capacity - 1;
+  size_t at = hash & mask;
+  while (table->slots[at].tree) at = (at + 1) & mask;
+  table->slots[at] = (Mori_Exact_Slot) { .tree = tree + 1, .hash = hash };
+  table->count += 1;
+}
+
+void mori_exact_table_delete(Mori_Exact_Table *table, uint32_t tree, uint32_t hash) {
+  if (table->capacity == 0) return;
+  size_t mask = table->capacity - 1;
+  size_t hole = hash & mask;
+  for (; table->slots[hole].tree != tree + 1; hole = (hole + 1) & mask) {
+    // Trees with an empty key were never put in
+    if (!table->slots[hole].tree) return;
+  }
+
+  // Everything after the hole in the same run that may sit earlier than it does moves back into the hole
+  for (size_t next = (hole + 1) & mask; table->slots[next].tree; next = (next + 1) & mask) {
+    size_t home = table->slots[next].hash & mask;
+    if (((next - home) & mask) < ((next - hole) & mask)) continue;
+    table->slots[hole] = table->slots[next];
+    hole = next;
+  }
+  table->slots[hole] = (Mori_Exact_Slot) {0};
+  table->count -= 1;
+}
+
+// Puts tree `i` in the index, `i` is either a new last tree or one that was just removed
+void mori_exact_add(size_t i) {
+  if (!exact.ready) return;
+  for (size_t field = 0; field < MORI_EXACT_COUNT; ++field) {
+    String_View key = mori_exact_key((Mori_Exact_Field)field, i);
+    uint32_t hash = mori_exact_hash((Mori_Exact_Field)field, key);
+    if (i == exact.hashes[field].count) da_append(&exact.hashes[field], hash);
+    else exact.hashes[field].items[i] = hash;
+    if (key.count) mori_exact_table_put(&exact.tables[field], (uint32_t)i, hash);
+  }
+}
+
+// Takes tree `i` out of the index, and moves the trees after it down by one when it was deleted
+void mori_exact_remove(size_t i, bool deleted) {
+  if (!exact.ready) return;
+  for (size_t field = 0; field < MORI_EXACT_COUNT; ++field) {
+    Mori_Exact_Table *table = &exact.tables[field];
+    Mori_Exact_Hashes *hashes = &exact.hashes[field];
+    mori_exact_table_delete(table, (uint32_t)i, hashes->items[i]);
+    if (!deleted) continue;
+
+    memmove(hashes->items + i, hashes->items + i + 1, (hashes->count - i - 1)*sizeof(*hashes->items));
+    hashes->count -= 1;
+    // Shifting trees down keeps their hashes, so every slot stays where it is
+    for (size_t s = 0; s < table->capacity; ++s) {
+      if (table->slots[s].tree > i + 1) table->slots[s].tree -= 1;
+    }
+  }
+}
+
+void mori_exact_build() {
+  if (exact.ready) return;
+  uint64_t start = nob_nanos_since_unspecified_epoch();
+  mori_fold_names();
+  exact.ready = true;
+  for (size_t i = 0; i < mori.count; ++i) mori_exact_add(i);
+  nob_log(INFO, "Hashed the names and urls of %zu trees in %.3fms", mori.count,
+          (double)(nob_nanos_since_unspecified_epoch() - start)/1e6);
+}
+
+// Puts the indices of the trees whose folded name (or url) is exactly `key` in ntemp, in order, and returns how
+// many there are. `key` has to be folded already for names. Scans when the index isn't built.
+size_t mori_exact_lookup(Mori_Exact_Field field, String_View key, uint32_t **matches) {
+  mori_fold_names();
+  size_t found = 0;
+  *matches = NULL;
+  if (key.count == 0) return 0;
+
+  if (!exact.ready) {
+    *matches = ntemp_alloc(mori.count*sizeof(**matches));
+    for (size_t i = 0; i < mori.count; ++i) {
+      if (mori_exact_key_eq(field, mori_exact_key(field, i), key)) (*matches)[found++] = (uint32_t)i;
+    }
+    return found;
+  }
+
+  const Mori_Exact_Table *table = &exact.tables[field];
+  if (table->capacity == 0) return 0;
+  size_t mask = table->capacity - 1;
+  uint32_t hash = mori_exact_hash(field, key);
+  *matches = ntemp_alloc(table->count*sizeof(**matches));
+  for (size_t at = hash & mask; table->slots[at].tree; at = (at + 1) & mask) {
+    uint32_t tree = table->slots[at].tree - 1;
+    if (table->slots[at].hash != hash || !mori_exact_key_eq(field, mori_exact_key(field, tree), key)) continue;
+    size_t m = found++;
+    for (; m > 0 && (*matches)[m - 1] > tree; --m) (*matches)[m] = (*matches)[m - 1];
+    (*matches)[m] = tree;
+  }
+  return found;
+}
+
+void mori_exact_free() {
+  for (size_t field = 0; field < MORI_EXACT_COUNT; ++field) {
+    free(exact.tables[field].slots);
+    da_free(exact.hashes[field]);
+  }
+  memset(&exact, 0, sizeof(exact));
+}
+
+// Rebuilds the buffer with only the strings trees still point at, returns the bytes reclaimed
+size_t mori_compact_heap() {
+  size_t old_size = mori_heap_size();
+  String_Builder compacted = {0};
+  da_reserve(&compacted, mori.heap_live);
+
+  for (size_t i = 0; i < mori.count; ++i) {
+    String_View name = mori_name(i).length ? bufsv_trim_zero_padding(mori_name(i)) : (String_View){0};
+    String_View url = mori_url(i).length ? bufsv_trim_zero_padding(mori_url(i)) : (String_View){0};
+    mori_name(i) = (Buffered_String_View) { .index = (uint32_t)compacted.count, .length = (uint32_t)name.count };
+    if (name.count) sb_append_buf(&compacted, name.data, name.count);
+    mori_url(i) = (Buffered_String_View) { .index = (uint32_t)compacted.count, .length = (uint32_t)url.count };
+    if (url.count) sb_append_buf(&compacted, url.data, url.count);
+    if (!mori.folded_ready) continue;
+    String_View folded = mori_folded(i).length ? bufsv_trim_zero_padding(mori_folded(i)) : (String_View){0};
+    mori_folded(i) = (Buffered_String_View) { .index = (uint32_t)compacted.count, .length = (uint32_t)folded.count };
+    if (folded.count) sb_append_buf(&compacted, folded.data, folded.count);
+  }
+
+  if (mori.mapped_size) {
+    munmap(mori.buffer.items, mori.mapped_size);
+    mori.mapped_size = 0;
+  } else {
+    sb_free(&mori.buffer);
+  }
+  sb_free(&mori.overlay);
+  mori.buffer = compacted;
+  mori.heap_live = compacted.count;
+  mori_heap_clear_free_lists();
+
+  size_t reclaimed = old_size - compacted.count;
+  nob_log(INFO, "Compacted string heap from %zu to %zu bytes, reclaimed %zu bytes", old_size, compacted.count, reclaimed);
+  return reclaimed;
+}
+
+// Compacts once the garbage crosses MORI_HEAP_GARBAGE_RATIO, returns the bytes reclaimed
+size_t mori_maybe_compact_heap() {
+  size_t heap_size = mori_heap_size();
+  if (heap_size < MORI_HEAP_COMPACT_MIN_SIZE) return 0;
+  size_t garbage = heap_size - mori.heap_live;
+  if ((double)garbage <= MORI_HEAP_GARBAGE_RATIO*(double)heap_size) return 0;
+  return mori_compact_heap();
+}
+
+// Reads a u32 at the cursor and moves the cursor past it, the bytes are left untouched.
+bool read_u32_at_cursor(const String_Builder *buffer, size_t *cursor, uint32_t *value) {
+  if (buffer->count - *cursor < sizeof(uint32_t)) return false;
+  memcpy(value, buffer->items + *cursor, sizeof(uint32_t));
+  *cursor += sizeof(uint32_t);
+  return true;
+}
+
+// Decodes a single v0 tree starting at `offset` in one pass. The name and url views point
+// straight at their original bytes in `buffer` so nothing is ever moved or copied.
+bool get_v0_mori_tree_from_bytes(String_Builder *buffer, size_t *offset, Mori_Tree *tree, bool *errored) {
+  *errored = false;
+  if (*offset > buffer->count) {
+    nob_log(ERROR, "Internal Error: Attempting to reach outside of the allocated buffer");
+    *errored = true;
+    return false;
+  }
+  size_t bytes_len = buffer->count - (*offset);
+  if (bytes_len == 0) return false;
+  if (bytes_len == 1) {
+    char b = buffer->items[*offset];
+    nob_log(INFO, "Hit a single byte: %d -> '%c'", b, b);
+    if (b == '\n') {
+      *offset += 1;
+      return false;
+    }
+  }
+
+  size_t cursor = *offset;
+  uint32_t name_len = 0, url_len = 0;
+
+  if (!read_u32_at_cursor(buffer, &cursor, &name_len)) {
+    nob_log(ERROR, "Malformed Mori Tree: Expected name length as a ui32 at the start of a mori_tree");
+    *errored = true;
+    return false;
+  }
+  if (buffer->count - cursor < name_len) {
+    nob_log(ERROR, "Malformed Mori Tree: Not enough data exists in file to read name");
+    *errored = true;
+    return false;
+  }
+  tree->name = (Buffered_String_View) { .index = (uint32_t)cursor, .length = name_len };
+  cursor += name_len;
+  nob_log(INFO, "Loading manga: '%.*s'...", (int)name_len, buffer->items + tree->name.index);
+
+  if (!read_u32_at_cursor(buffer, &cursor, &url_len)) {
+    nob_log(ERROR, "Malformed Mori Tree: Expected url length as a ui32 after name");
+    *errored = true;
+    return false;
+  }
+  if (buffer->count - cursor < url_len) {
+    nob_log(ERROR, "Malformed Mori Tree: Not enough data exists in file to read url");
+    *errored = true;
+    return false;
+  }
+  tree->url = (Buffered_String_View) { .index = (uint32_t)cursor, .length = url_len };
+  cursor += url_len;
+
+  if (!read_u32_at_cursor(buffer, &cursor, &tree->chapter)) {
+    nob_log(ERROR, "Malformed Mori Tree: Expected chapters count as a ui32 after url");
+    *errored = true;
+    return false;
+  }
+  nob_log(INFO, "    Chapter: %u", tree->chapter);
+
+  if (!read_u32_at_cursor(buffer, &cursor, &tree->volume)) {
+    nob_log(ERROR, "Malformed Mori Tree: Expected volumes count as a ui32 after chapters");
+    *errored = true;
+    return false;
+  }
+  nob_log(INFO, "    Volume: %u", tree->volume);
+
+  *offset = cursor;
+  return true;
+}
+
+// Copies the header out of the buffer, fields the file predates are left zeroed
+bool read_mori_v1_header(const String_Builder *buffer, Mori_V1_Header *header) {
+  memset(header, 0, sizeof(*header));
+  if (buffer->count < offsetof(Mori_V1_Header, header_size) + sizeof(header->header_size)) {
+    nob_log(ERROR, "Malformed morimori v1: Header is cut short");
+    return false;
+  }
+  uint16_t header_size = 0;
+  memcpy(&header_size, buffer->items + offsetof(Mori_V1_Header, header_size), sizeof(header_size));
+  if (header_size < MORI_V1_MIN_HEADER_SIZE || buffer->count < header_size) {
+    nob_log(ERROR, "Malformed morimori v1: Header is cut short");
+    return false;
+  }
+  memcpy(header, buffer->items, header_size < sizeof(*header) ? header_size : sizeof(*header));
+
+  if (header->record_size < MORI_V1_MIN_RECORD_SIZE) {
+    nob_log(ERROR, "Malformed morimori v1: Record size %u is too small", header->record_size);
+    return false;
+  }
+  if (header->records_offset > buffer->count ||
+      (buffer->count - header->records_offset) / header->record_size < header->tree_count) {
+    nob_log(ERROR, "Malformed morimori v1: Record table does not fit in file");
+    return false;
+  }
+  if (header->heap_offset > buffer->count || buffer->count - header->heap_offset < header->heap_size) {
+    nob_log(ERROR, "Malformed morimori v1: String heap does not fit in file");
+    return false;
+  }
+  return true;
+}
+
+// Random access into a v1 file already in memory: decodes tree `i` without looking at any other record.
+// `folded` is optional and only filled in when the file has folded names.
+bool get_v1_mori_tree(String_Builder *buffer, const Mori_V1_Header *header, size_t i, Mori_Tree *tree, Buffered_String_View *folded) {
+  Mori_V1_Record record = {0};
+  memcpy(&record, buffer->items + header->records_offset + i*header->record_size,
+         header->record_size < sizeof(record) ? header->record_size : sizeof(record));
+
+  if (record.name_offset > header->heap_size || header->heap_size - record.name_offset < record.name_length ||
+      record.url_offset > header->heap_size || header->heap_size - record.url_offset < record.url_length) {
+    nob_log(ERROR, "Malformed Mori Tree: Record %zu points outside of the string heap", i);
+    return false;
+  }
+
+  tree->name = (Buffered_String_View) {
+    .index = (uint32_t)(header->heap_offset + record.name_offset),
+    .length = record.name_length,
+  };
+  tree->url = (Buffered_String_View) {
+    .index = (uint32_t)(header->heap_offset + record.url_offset),
+    .length = record.url_length,
+  };
+  tree->chapter = record.chapter;
+  tree->volume = record.volume;
+
+  if (folded) {
+    if (record.folded_offset > header->heap_size || header->heap_size - record.folded_offset < record.folded_length) {
+      nob_log(ERROR, "Malformed Mori Tree: Folded name of record %zu points outside of the string heap", i);
+      return false;
+    }
+    *folded = (Buffered_String_View) {
+      .index = (uint32_t)(header->heap_offset + record.folded_offset),
+      .length = record.folded_length,
+    };
+  }
+  return true;
+}
+
+bool parse_morimori_bytes(String_Builder *sb) {
+  if (sb->count < MORI_HEADER_SIZE) {
+    nob_log(ERROR, "morimori file is missing header");
+    return false;
+  }
+  if (sb->count > UINT32_MAX) {
+    nob_log(ERROR, "morimori file is bigger than the 4GiB a forest can hold");
+    return false;
+  }
+
+  for (size_t i = 0; i < MORI_HEADER_SIZE - 1; ++i) {
+    byte_t b = sb->items[i];
+    if (b != mori_header[i]) {
+      nob_log(ERROR, "Invalid morimori header");
+      return false;
+    }
+  }
+
+  byte_t v = *(sb->items + (MORI_HEADER_SIZE - 1));
+  if (v > MORI_VERSION) {
+    nob_log(ERROR, "Invalid version in header");
+    return false;
+  }
+
+  // The header stays in the buffer, trees are read right after it
+  size_t offset = MORI_HEADER_SIZE;
+  mori.version = v;
+  mori.snapshot_id = 0;
+
+  switch (v) {
+  case 0:
+    nob_log(INFO, "Loading morimori v0...");
+    while (sb->count - offset) {
+      Mori_Tree tree = {0};
+      bool errored = false;
+      if (!get_v0_mori_tree_from_bytes(sb, &offset, &tree, &errored)) {
+	if (errored) nob_log(NOB_ERROR, "Failed to read v0 mori tree bytes");
+	return !errored;
+      }
+      if (tree.name.length) mori_append(tree);
+    }
+    mori_recount_heap_live();
+    return true;
+
+  case 1: {
+    nob_log(INFO, "Loading morimori v1...");
+    Mori_V1_Header header = {0};
+    if (!read_mori_v1_header(sb, &header)) return false;
+    mori.snapshot_id = header.snapshot_id;
+
+    bool has_folded = header.record_size >= sizeof(Mori_V1_Record) && header.fold_version == MORI_FOLD_VERSION;
+    mori_reserve(mori.count + header.tree_count);
+    for (size_t i = 0; i < header.tree_count; ++i) {
+      Mori_Tree tree = {0};
+      Buffered_String_View folded = {0};
+      if (!get_v1_mori_tree(sb, &header, i, &tree, has_folded ? &folded : NULL)) return false;
+      mori_append(tree);
+      mori_folded(mori.count - 1) = folded;
+    }
+    mori.folded_ready = has_folded;
+    mori_recount_heap_live();
+    return true;
+  }
+
+  default:
+    nob_log(ERROR, "Unhandled version %d", (int)v);
+    return false;
+  }
+}
+
+bool read_morimori_file(String_Builder *sb, const char *morimori_file_path) {
+  nob_log(INFO, "Reading morimori file...");
+  sb->count = 0;
+  if (!read_entire_file(morimori_file_path, sb)) {
+    nob_log(WARNING, "Failed to read morimori file! Data in it will be ignored");
+    return false;
+  }
+  nob_log(INFO, "Bytes read: %zu", sb->count);
+
+  return parse_morimori_bytes(sb);
+}
+
+// Maps the morimori file read-only and parses it in place so names and urls are served straight out
+// of the page cache. Strings added on top, like the ones of a replayed journal, go to mori.overlay.
+bool map_morimori_file(String_Builder *sb, const char *morimori_file_path) {
+  nob_log(INFO, "Mapping morimori file...");
+  bool result = true;
+  int fd = open(morimori_file_path, O_RDONLY);
+  if (fd < 0) {
+    nob_log(ERROR, "Could not open morimori file %s: %s", morimori_file_path, strerror(errno));
+    return false;
+  }
+
+  struct stat st = {0};
+  if (fstat(fd, &st) < 0) {
+    nob_log(ERROR, "Could not stat morimori file %s: %s", morimori_file_path, strerror(errno));
+    nob_return_defer(false);
+  }
+  if ((size_t)st.st_size < MORI_HEADER_SIZE) {
+    nob_log(ERROR, "morimori file is missing header");
+    nob_return_defer(false);
+  }
+
+  void *bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (bytes == MAP_FAILED) {
+    nob_log(ERROR, "Could not map morimori file %s: %s", morimori_file_path, strerror(errno));
+    nob_return_defer(false);
+  }
+  madvise(bytes, (size_t)st.st_size, MADV_SEQUENTIAL);
+  nob_log(INFO, "Bytes mapped: %zu", (size_t)st.st_size);
+
+  sb->items = (char*)bytes;
+  sb->count = (size_t)st.st_size;
+  sb->capacity = 0;
+  mori.mapped_size = (size_t)st.st_size;
+
+  result = parse_morimori_bytes(sb);
+
+defer:
+  close(fd);
+  return result;
+}
+
+void mori_query_cache_free();
+
+// Releases the forest regardless of whether it was read into the heap or mapped
+void unload_morimori() {
+  if (mori.mapped_size) {
+    munmap(mori.buffer.items, mori.mapped_size);
+    memset(&mori.buffer, 0, sizeof(mori.buffer));
+    mori.mapped_size = 0;
+  } else {
+    sb_free(&mori.buffer);
+  }
+  sb_free(&mori.overlay);
+  for (size_t k = 0; k < MORI_HEAP_SIZE_CLASSES; ++k) {
+    da_free(mori.free_lists[k]);
+    memset(&mori.free_lists[k], 0, sizeof(mori.free_lists[k]));
+  }
+  mori_free_trees();
+  mori_trigram_free();
+  mori_prefix_free();
+  mori_orders_free();
+  mori_exact_free();
+  mori_query_cache_free();
+}
+
+#define MORI_WRITE_BATCH_RECORDS 2048
+#define MORI_WRITE_BATCH_IOVECS  1024
+
+bool write_all(int fd, const void *data, size_t size) {
+  const char *bytes = data;
+  while (size > 0) {
+    ssize_t n = write(fd, bytes, size);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    bytes += n;
+    size -= (size_t)n;
+  }
+  return true;
+}
+
+// Writes every iovec, picking up where a short write left off. The iovecs are consumed in the process.
+bool writev_all(int fd, struct iovec *iov, int iov_count) {
+  while (iov_count > 0) {
+    ssize_t n = writev(fd, iov, iov_count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    while (iov_count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iov_count--;
+    }
+    if (iov_count > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+  return true;
+}
+
+// Streams the forest to the fd as morimori v1. Offsets are known upfront from the string lengths so
+// records and strings go straight to the fd in fixed size batches, nothing scales with the forest size.
+bool stream_morimori_to_fd(int fd) {
+  bool persist_folded = MORI_PERSIST_FOLDED_NAMES;
+  if (persist_folded) mori_fold_names();
+
+  Mori_V1_Header header = {0};
+  memcpy(header.magic, mori_header, MORI_HEADER_SIZE);
+  header.header_size = sizeof(Mori_V1_Header);
+  header.tree_count = (uint32_t)mori.count;
+  header.record_size = persist_folded ? sizeof(Mori_V1_Record) : MORI_V1_MIN_RECORD_SIZE;
+  header.records_offset = sizeof(Mori_V1_Header);
+  header.heap_offset = header.records_offset + mori.count*header.record_size;
+  header.snapshot_id = mori.snapshot_id + 1;
+  header.fold_version = persist_folded ? MORI_FOLD_VERSION : 0;
+  for (size_t i = 0; i < mori.count; ++i) {
+    header.heap_size += mori_name(i).length + mori_url(i).length;
+    if (persist_folded) header.heap_size += mori_folded(i).length;
+  }
+
+  if (header.heap_size > UINT32_MAX) {
+    nob_log(ERROR, "Your 森 has outgrown the 4GiB string heap of morimori v1");
+    return false;
+  }
+
+  if (!write_all(fd, &header, sizeof(header))) return false;
+
+  // Records are packed at record_size, which drops the folded name fields when they aren't persisted
+  byte_t records[MORI_WRITE_BATCH_RECORDS*sizeof(Mori_V1_Record)];
+  size_t records_count = 0;
+  uint32_t heap_cursor = 0;
+  for (size_t i = 0; i < mori.count; ++i) {
+    Mori_V1_Record record = {
+      .name_offset = heap_cursor,
+      .name_length = mori_name(i).length,
+      .url_offset  = heap_cursor + mori_name(i).length,
+      .url_length  = mori_url(i).length,
+      .chapter     = mori_chapter(i),
+      .volume      = mori_volume(i),
+    };
+    heap_cursor += mori_name(i).length + mori_url(i).length;
+    if (persist_folded) {
+      record.folded_offset = heap_cursor;
+      record.folded_length = mori_folded(i).length;
+      heap_cursor += mori_folded(i).length;
+    }
+    memcpy(records + records_count++*header.record_size, &record, header.record_size);
+
+    if (records_count == MORI_WRITE_BATCH_RECORDS) {
+      if (!write_all(fd, records, records_count*header.record_size)) return false;
+      records_count = 0;
+    }
+  }
+  if (records_count > 0 && !write_all(fd, records, records_count*header.record_size)) return false;
+
+  struct iovec iov[MORI_WRITE_BATCH_IOVECS];
+  int iov_count = 0;
+  for (size_t i = 0; i < mori.count; ++i) {
+    if (iov_count + 3 > MORI_WRITE_BATCH_IOVECS) {
+      if (!writev_all(fd, iov, iov_count)) return false;
+      iov_count = 0;
+    }
+    if (mori_name(i).length > 0) iov[iov_count++] = (struct iovec) { bufsv_data(mori_name(i)), mori_name(i).length };
+    if (mori_url(i).length > 0) iov[iov_count++] = (struct iovec) { bufsv_data(mori_url(i)), mori_url(i).length };
+    if (persist_folded && mori_folded(i).length > 0) {
+      iov[iov_count++] = (struct iovec) { bufsv_data(mori_folded(i)), mori_folded(i).length };
+    }
+  }
+  if (iov_count > 0 && !writev_all(fd, iov, iov_count)) return false;
+
+  return true;
+}
+
+// Makes a rename inside of the directory durable
+bool fsync_parent_dir(const char *file_path) {
+  const char *slash = strrchr(file_path, '/');
+  size_t save_point = nob_temp_save();
+  const char *dir_path = slash ? nob_temp_sv_to_cstr(sv_from_parts(file_path, slash == file_path ? 1 : (size_t)(slash - file_path))) : ".";
+  int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY);
+  nob_temp_rewind(save_point);
+  if (dir_fd < 0) return false;
+
+  bool ok = fsync(dir_fd) == 0;
+  close(dir_fd);
+  return ok;
+}
+
+typedef struct {
+  uint64_t write_ns;
+  uint64_t fsync_ns;
+  // Rename over the original and fsync of its directory
+  uint64_t rename_ns;
+} Mori_Save_Timings;
+
+// Saves are crash safe: the forest is streamed into a sibling temp file which is fsync'd and then
+// renamed over the original, so at any point the file on disk is either the old or the new forest.
+// The temp file gets the mode of the file it replaces. `timings` is optional.
+bool write_morimori_file(const char *file_path, Mori_Save_Timings *timings) {
+  bool result = true;
+  uint64_t start = nob_nanos_since_unspecified_epoch();
+  size_t save_point = nob_temp_save();
+  const char *tmp_path = nob_temp_sprintf("%s.tmp", file_path);
+
+  struct stat original = {0};
+  mode_t mode = stat(file_path, &original) == 0 ? (original.st_mode & 07777) : 0644;
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+  if (fd < 0) {
+    nob_log(ERROR, "Could not open morimori file %s: %s", tmp_path, strerror(errno));
+    nob_temp_rewind(save_point);
+    return false;
+  }
+  // The umask only applies to new files, the original's mode is kept as is
+  if (original.st_mode && fchmod(fd, mode) < 0) {
+    nob_log(WARNING, "Could not set the mode of %s: %s", tmp_path, strerror(errno));
+  }
+
+  if (!stream_morimori_to_fd(fd)) {
+    nob_log(ERROR, "Could not write morimori file %s: %s", tmp_path, strerror(errno));
+    close(fd);
+    nob_return_defer(false);
+  }
+  uint64_t written = nob_nanos_since_unspecified_epoch();
+
+  if (fsync(fd) < 0) {
+    nob_log(ERROR, "Could not sync morimori file %s: %s", tmp_path, strerror(errno));
+    close(fd);
+    nob_return_defer(false);
+  }
+  close(fd);
+  uint64_t synced = nob_nanos_since_unspecified_epoch();
+
+  if (!nob_rename(tmp_path, file_path)) nob_return_defer(false);
+  if (!fsync_parent_dir(file_path)) {
+    nob_log(WARNING, "Could not sync directory of %s: %s", file_path, strerror(errno));
+  }
+
+  mori.snapshot_id++;
+  mori.version = MORI_VERSION;
+
+  uint64_t done = nob_nanos_since_unspecified_epoch();
+  if (timings) {
+    timings->write_ns = written - start;
+    timings->fsync_ns = synced - written;
+    timings->rename_ns = done - synced;
+  }
+  nob_log(INFO, "Saved %zu trees in %.3fms (write %.3fms, fsync %.3fms, rename %.3fms)", mori.count,
+          (double)(done - start)/1e6, (double)(written - start)/1e6, (double)(synced - written)/1e6,
+          (double)(done - synced)/1e6);
+  nob_temp_rewind(save_point);
+  return true;
+
+defer:
+  nob_delete_file(tmp_path);
+  nob_temp_rewind(save_point);
+  return result;
+}
+
+#define MORI_BENCH_SAVE_DEFAULT_RUNS 10
+
+int mori_compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// `mori bench-save`: saves the loaded forest `runs` times next to the real file and reports how long the
+// write, the fsync and the rename each take, so the cost of the crash safety can be told apart
+bool bench_save(const char *morimori_file_path, size_t runs) {
+  const char *bench_path = nob_temp_sprintf("%s.bench", morimori_file_path);
+  uint64_t *samples[3] = {0};
+  for (size_t k = 0; k < 3; ++k) samples[k] = ntemp_alloc(runs*sizeof(*samples[k]));
+
+  for (size_t run = 0; run < runs; ++run) {
+    Mori_Save_Timings timings = {0};
+    if (!write_morimori_file(bench_path, &timings)) {
+      nob_delete_file(bench_path);
+      return false;
+    }
+    samples[0][run] = timings.write_ns;
+    samples[1][run] = timings.fsync_ns;
+    samples[2][run] = timings.rename_ns;
+  }
+  struct stat bench_stat = {0};
+  stat(bench_path, &bench_stat);
+  nob_delete_file(bench_path);
+
+  const char *names[3] = { "write", "fsync", "rename" };
+  ansi_term_printn("Mori_Bench_Save :: struct {");
+  ansi_term_printfn("  .Trees = %zu;", mori.count);
+  ansi_term_printfn("  .Bytes = %lld;", (long long)bench_stat.st_size);
+  ansi_term_printfn("  .Runs  = %zu;", runs);
+  for (size_t k = 0; k < 3; ++k) {
+    qsort(samples[k], runs, sizeof(*samples[k]), mori_compare_u64);
+    ansi_term_printfn("  .%-6s = { .min = %.3fms, .median = %.3fms, .max = %.3fms };", names[k],
+                      (double)samples[k][0]/1e6, (double)samples[k][runs/2]/1e6, (double)samples[k][runs - 1]/1e6);
+  }
+  ansi_term_printn("}");
+  return true;
+}
+
+// Edit journal:
+// Every create/edit/delete done in the TUI is appended to `<morimori file>.journal` as a small record
+// instead of rewriting the whole forest. Loading replays the journal over the snapshot and once it grows
+// past MORI_JOURNAL_COMPACT_THRESHOLD it is folded back into a fresh snapshot and removed.
+//
+//   Mori_Journal_Header                     (snapshot_id of the morimori file it applies to)
+//   Mori_Journal_Record, payload ...        (repeated)
+//
+// Create and set records carry the whole tree as payload: name_length, url_length, chapter, volume (u32
+// each) followed by the name and url bytes. A record whose checksum does not match, like one torn by a
+// crash mid-append, ends the replay.
+#ifndef MORI_JOURNAL_COMPACT_THRESHOLD
+#define MORI_JOURNAL_COMPACT_THRESHOLD (1024*1024)
+#endif // MORI_JOURNAL_COMPACT_THRESHOLD
+
+#define MORI_JOURNAL_MAGIC "MORJ"
+#define MORI_JOURNAL_VERSION 1
+
+typedef enum {
+  MORI_JOURNAL_CREATE = 1,
+  MORI_JOURNAL_SET    = 2,
+  MORI_JOURNAL_DELETE = 3,
+} Mori_Journal_Op;
+
+typedef struct {
+  char     magic[4];
+  uint32_t version;
+  uint64_t snapshot_id;
+} Mori_Journal_Header;
+
+typedef struct {
+  uint32_t op;
+  uint32_t index;
+  uint32_t payload_size;
+  uint32_t checksum;
+} Mori_Journal_Record;
+
+typedef struct {
+  const char *path;
+  int fd;
+  size_t size;
+  // Set when an append failed, the forest then has to be saved in full to not lose the edit
+  bool failed;
+} Mori_Journal;
+
+Mori_Journal journal = { .fd = -1 };
+
+const char *get_journal_file_path(const char *morimori_file_path) {
+  return nob_temp_sprintf("%s.journal", morimori_file_path);
+}
+
+uint32_t fnv1a32(uint32_t hash, const void *data, size_t size) {
+  const byte_t *bytes = data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t journal_record_checksum(const Mori_Journal_Record *record, const char *payload) {
+  uint32_t hash = 2166136261u;
+  hash = fnv1a32(hash, &record->op, sizeof(record->op));
+  hash = fnv1a32(hash, &record->index, sizeof(record->index));
+  hash = fnv1a32(hash, &record->payload_size, sizeof(record->payload_size));
+  return fnv1a32(hash, payload, record->payload_size);
+}
+
+bool replay_journal_record(const Mori_Journal_Record *record, const char *payload) {
+  switch ((Mori_Journal_Op)record->op) {
+  case MORI_JOURNAL_CREATE:
+  case MORI_JOURNAL_SET: {
+    if (record->op == MORI_JOURNAL_CREATE && record->index != mori.count) return false;
+    if (record->op == MORI_JOURNAL_SET && record->index >= mori.count) return false;
+
+    uint32_t fields[4] = {0};
+    if (record->payload_size < sizeof(fields)) return false;
+    memcpy(fields, payload, sizeof(fields));
+    uint32_t name_length = fields[0], url_length = fields[1];
+    if (record->payload_size - sizeof(fields) != (size_t)name_length + url_length) return false;
+
+    Mori_Tree tree = { .chapter = fields[2], .volume = fields[3] };
+    tree.name = mori_heap_push(sv_from_parts(payload + sizeof(fields), name_length));
+    tree.url = mori_heap_push(sv_from_parts(payload + sizeof(fields) + name_length, url_length));
+
+    if (record->op == MORI_JOURNAL_CREATE) {
+      mori_append(tree);
+    } else {
+      mori_heap_release(&mori_name(record->index));
+      mori_heap_release(&mori_url(record->index));
+      mori_set(record->index, tree);
+      mori_edited(record->index, true);
+    }
+    return true;
+  }
+
+  case MORI_JOURNAL_DELETE:
+    if (record->index >= mori.count) return false;
+    mori_delete_tree(record->index);
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+// Applies the journal next to the morimori file on top of the forest loaded from it. `valid_size` gets
+// how many bytes of the journal were good, anything past that is garbage to be cut off before appending.
+bool replay_journal(const char *journal_path, size_t *valid_size) {
+  *valid_size = 0;
+  if (!nob_file_exists(journal_path)) return true;
+
+  String_Builder bytes = {0};
+  bool result = true;
+  if (!read_entire_file(journal_path, &bytes)) nob_return_defer(false);
+
+  Mori_Journal_Header header = {0};
+  if (bytes.count < sizeof(header)) nob_return_defer(true);
+  memcpy(&header, bytes.items, sizeof(header));
+  if (memcmp(header.magic, MORI_JOURNAL_MAGIC, 4) != 0 || header.version != MORI_JOURNAL_VERSION) {
+    nob_log(WARNING, "Ignoring journal %s with an invalid header", journal_path);
+    nob_return_defer(true);
+  }
+  // A compaction that got to swap in its snapshot but not to remove the journal leaves it behind
+  if (header.snapshot_id != mori.snapshot_id) {
+    nob_log(INFO, "Ignoring journal of snapshot %llu, forest is at snapshot %llu",
+            (unsigned long long)header.snapshot_id, (unsigned long long)mori.snapshot_id);
+    nob_return_defer(true);
+  }
+
+  size_t cursor = sizeof(header);
+  size_t replayed = 0;
+  while (bytes.count - cursor >= sizeof(Mori_Journal_Record)) {
+    Mori_Journal_Record record = {0};
+    memcpy(&record, bytes.items + cursor, sizeof(record));
+    const char *payload = bytes.items + cursor + sizeof(record);
+    if (bytes.count - cursor - sizeof(record) < record.payload_size) break;
+    if (journal_record_checksum(&record, payload) != record.checksum) break;
+    if (!replay_journal_record(&record, payload)) {
+      nob_log(WARNING, "Journal record %zu does not apply to your 森, ignoring the rest of the journal", replayed);
+      break;
+    }
+    cursor += sizeof(record) + record.payload_size;
+    replayed++;
+  }
+  if (cursor < bytes.count) nob_log(WARNING, "Dropped %zu trailing bytes from the journal", bytes.count - cursor);
+  nob_log(INFO, "Replayed %zu journal records", replayed);
+  *valid_size = cursor;
+
+defer:
+  sb_free(&bytes);
+  return result;
+}
+
+// How often a bounded wait for the journal lock tries again
+#define MORI_JOURNAL_LOCK_POLL_MS 10
+
+// Takes the journal lock and opens the journal for appending. Only one session can hold it, including a
+// background compaction of a previous session. With a negative `timeout_ms` it waits for as long as it
+// takes, otherwise it gives up once the lock was taken for `timeout_ms`.
+bool open_journal(const char *morimori_file_path, int timeout_ms) {
+  journal.path = strdup(get_journal_file_path(morimori_file_path));
+  uint64_t deadline = nob_nanos_since_unspecified_epoch() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0)*1000000;
+
+  while (true) {
+    journal.fd = open(journal.path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (journal.fd < 0) {
+      nob_log(ERROR, "Could not open journal %s: %s", journal.path, strerror(errno));
+      return false;
+    }
+    if (timeout_ms >= 0) {
+      while (flock(journal.fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK || nob_nanos_since_unspecified_epoch() >= deadline) {
+          nob_log(ERROR, "Your 森 is open in another mori");
+          close(journal.fd);
+          journal.fd = -1;
+          return false;
+        }
+        usleep(MORI_JOURNAL_LOCK_POLL_MS*1000);
+      }
+    } else if (flock(journal.fd, LOCK_EX | LOCK_NB) < 0) {
+      nob_log(WARNING, "Waiting for another mori to let go of your 森...");
+      if (flock(journal.fd, LOCK_EX) < 0) {
+        nob_log(ERROR, "Could not lock journal %s: %s", journal.path, strerror(errno));
+        return false;
+      }
+    }
+
+    // Whoever held the lock may have compacted and removed the journal we are holding
+    struct stat st = {0};
+    if (fstat(journal.fd, &st) == 0 && st.st_nlink > 0) break;
+    close(journal.fd);
+  }
+
+  return true;
+}
+
+// Called once the forest has been loaded and the journal replayed on top of it
+bool start_journal(size_t valid_size) {
+  bool fresh = valid_size < sizeof(Mori_Journal_Header);
+  if (ftruncate(journal.fd, fresh ? 0 : (off_t)valid_size) < 0) {
+    nob_log(ERROR, "Could not truncate journal %s: %s", journal.path, strerror(errno));
+    return false;
+  }
+  journal.size = fresh ? 0 : valid_size;
+  if (!fresh) return true;
+
+  Mori_Journal_Header header = { .version = MORI_JOURNAL_VERSION, .snapshot_id = mori.snapshot_id };
+  memcpy(header.magic, MORI_JOURNAL_MAGIC, 4);
+  if (!write_all(journal.fd, &header, sizeof(header))) {
+    nob_log(ERROR, "Could not write journal %s: %s", journal.path, strerror(errno));
+    return false;
+  }
+  journal.size = sizeof(header);
+  return true;
+}
+
+void journal_append(Mori_Journal_Op op, size_t index) {
+  // Every edit of the session goes through here, so cached query results of before it are stale now
+  mori.generation += 1;
+  if (journal.fd < 0 || journal.failed) {
+    journal.failed = true;
+    return;
+  }
+
+  Mori_Journal_Record record = { .op = op, .index = (uint32_t)index };
+  String_Builder payload = {0};
+  if (op != MORI_JOURNAL_DELETE) {
+    Mori_Tree tree = mori_get(index);
+    uint32_t fields[4] = { tree.name.length, tree.url.length, tree.chapter, tree.volume };
+    sb_append_buf(&payload, fields, sizeof(fields));
+    if (tree.name.length) sb_append_buf(&payload, bufsv_data(tree.name), tree.name.length);
+    if (tree.url.length) sb_append_buf(&payload, bufsv_data(tree.url), tree.url.length);
+  }
+  record.payload_size = (uint32_t)payload.count;
+  record.checksum = journal_record_checksum(&record, payload.items);
+
+  struct iovec iov[2] = {
+    { &record, sizeof(record) },
+    { payload.items, payload.count },
+  };
+  if (writev_all(journal.fd, iov, payload.count ? 2 : 1)) {
+    journal.size += sizeof(record) + record.payload_size;
+  } else {
+    nob_log(ERROR, "Could not append to journal %s: %s", journal.path, strerror(errno));
+    journal.failed = true;
+  }
+  sb_free(&payload);
+}
+
+// Folds the journal into a fresh snapshot. The snapshot is swapped in before the journal goes away and
+// the journal is tied to the old snapshot_id, so a crash in between never replays it twice.
+bool compact_morimori(const char *morimori_file_path) {
+  mori_compact_heap();
+  if (!write_morimori_file(morimori_file_path, NULL)) return false;
+  if (journal.path) unlink(journal.path);
+  return true;
+}
+
+// Saves the session: small journals are just synced, big ones are compacted in a child process so quitting
+// doesn't wait for the whole forest to be written. The child inherits the journal lock until it's done.
+// `reclaimed` gets the garbage of the string heap added when the save compacts it, it may be NULL
+bool save_morimori(const char *morimori_file_path, size_t *reclaimed) {
+  bool needs_compaction = journal.failed || mori.version < MORI_VERSION || journal.size > MORI_JOURNAL_COMPACT_THRESHOLD;
+  if (!needs_compaction) {
+    if (fsync(journal.fd) < 0) {
+      nob_log(ERROR, "Could not sync journal %s: %s", journal.path, strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  if (reclaimed) *reclaimed += mori_heap_size() - mori.heap_live;
+
+  // A failed journal means the child would be the only one holding the edits, better to wait for it
+  if (!journal.failed) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0) _exit(compact_morimori(morimori_file_path) ? 0 : 1);
+    if (pid > 0) return true;
+    nob_log(WARNING, "Could not compact in the background: %s", strerror(errno));
+  }
+
+  return compact_morimori(morimori_file_path);
+}
+
+void close_journal() {
+  if (journal.fd >= 0) close(journal.fd);
+  NOB_FREE(journal.path);
+  journal.fd = -1;
+  journal.size = 0;
+}
+
+// TODO: Also pass length so the user can go from the end by providing a negative index
+bool read_index_from_stdin(const char *prompt, size_t *value) {
+  const size_t cap = 1024;
+  char buf[cap];
+  int n = 0;
+
+  printf("%s ", prompt);
+  flush();
+
+  n = read(STDIN_FILENO, buf, cap);
+  if (n < 0) {
+    nob_log(ERROR, "Read failed: %s", strerror(errno));
+    return false;
+  }
+  // TODO: Transform it to an sv and trim it and handle negative sign
+  buf[(size_t)n >= cap ? cap - 1 : (size_t)n] = 0;
+
+  if (buf[0] == 'q') return false;
+
+  errno = 0;
+  size_t i = (size_t)strtoul(buf, NULL, 10);
+  if (errno != 0) {
+    nob_log(ERROR, "Invalid input: %s", strerror(errno));
+    return false;
+  }
+
+  *value = i;
+  return true;
+}
+
+void frame_line(const char *prefix, const char *text) {
+  ansi_term_frame_cstr(prefix);
+  ansi_term_frame_cstr(text);
+  ansi_term_frame_newline();
+}
+
+// Line of a displayed tree: the prefix, the text up to the value, the value and the text after it. Like the
+// "%.*s" it replaces, the value stops at its first NUL so zero padded names and urls print without it.
+void frame_tree_line(const char *prefix, const char *field, String_View value, const char *end) {
+  const char *nul = value.count ? memchr(value.data, 0, value.count) : NULL;
+  if (nul) value.count = (size_t)(nul - value.data);
+  ansi_term_frame_cstr(prefix);
+  ansi_term_frame_cstr(field);
+  ansi_term_frame_append(value.data, value.count);
+  ansi_term_frame_cstr(end);
+  ansi_term_frame_newline();
+}
+
+void frame_tree_number(const char *prefix, const char *field, uint64_t value) {
+  ansi_term_frame_cstr(prefix);
+  ansi_term_frame_cstr(field);
+  ansi_term_frame_u64(value);
+  ansi_term_frame_cstr(";");
+  ansi_term_frame_newline();
+}
+
+// The display_tree_* functions compose tree `i` into the frame, it's up to the caller to flush it
+void display_tree_short(size_t i, const char *prefix) {
+  Mori_Tree tree = mori_get(i);
+  String_View name = bufsv_to_sv(tree.name);
+  const size_t max_name_char_length = 35;
+  if (!prefix) prefix = "";
+
+  frame_line(prefix, "Mori_Tree :: struct {");
+  frame_tree_number(prefix, "  .Index   = ", i);
+  if (tree.name.length > max_name_char_length) {
+    // TODO: Actually split on a space or dash or colon as this can cut mid-word for not so nice views
+    frame_tree_line(prefix, "  .Name    = \"", sv_from_parts(name.data, max_name_char_length), "...\";");
+  } else {
+    frame_tree_line(prefix, "  .Name    = \"", name, "\";");
+  }
+  frame_tree_number(prefix, "  .Chapter = ", tree.chapter);
+  frame_line(prefix, "}");
+}
+
+void display_tree_full(size_t i, const char *prefix) {
+  Mori_Tree tree = mori_get(i);
+  if (!prefix) prefix = "";
+
+  frame_line(prefix, "Mori_Tree :: struct {");
+  frame_tree_number(prefix, "  .Index   = ", i);
+  frame_tree_line(prefix, "  .Name    = \"", bufsv_to_sv(tree.name), "\";");
+  if (tree.url.length == 0 || *bufsv_data(tree.url) == 0) {
+    frame_line(prefix, "  .Url     = None;");
+  } else {
+    frame_tree_line(prefix, "  .Url     = \"", bufsv_to_sv(tree.url), "\";");
+  }
+  frame_tree_number(prefix, "  .Chapter = ", tree.chapter);
+  frame_tree_number(prefix, "  .Volume  = ", tree.volume);
+  frame_line(prefix, "}");
+}
+
+// Heading of a listed tree, like `╟─ Index 12`
+void frame_tree_heading(const char *heading, size_t i) {
+  ansi_term_frame_cstr(heading);
+  ansi_term_frame_u64(i);
+  ansi_term_frame_newline();
+}
+
+void frame_list_end(const char *text, size_t count) {
+  ansi_term_frame_cstr(text);
+  ansi_term_frame_u64(count);
+  ansi_term_frame_cstr("];");
+  ansi_term_frame_newline();
+}
+
+// The whole list is composed first and written at once
+#define display_mori_tree_short_list(sort) display_mori_tree_short_list_offset(0, (sort))
+void display_mori_tree_short_list_offset(size_t offset, Mori_Sort_Key sort) {
+  const uint32_t *order = mori_order(sort);
+  frame_line("", "╓─<Your Manga Forest>");
+  for (size_t k = offset; k < mori.count; ++k) {
+    size_t i = order ? order[k] : k;
+    frame_tree_heading("╟─ Index ", i);
+    display_tree_short(i, "║    ");
+  }
+  frame_list_end("╙─ Mori_Tree mori[", mori.count);
+  ansi_term_frame_flush();
+}
+
+void display_mori_tree_full_list(Mori_Sort_Key sort) {
+  const uint32_t *order = mori_order(sort);
+  frame_line("", "╓─<Your Manga Forest>");
+  for (size_t k = 0; k < mori.count; ++k) {
+    size_t i = order ? order[k] : k;
+    frame_tree_heading("╟─ Index ", i);
+    display_tree_full(i, "║    ");
+  }
+  frame_list_end("╙─ Mori_Tree mori[", mori.count);
+  ansi_term_frame_flush();
+}
+
+#define GLOBAL_CMD_INIT_CAP 16
+Nob_Cmd cmd = {0};
+
+// Order the 'l' action lists the forest in, the 'o' action cycles through them
+Mori_Sort_Key list_sort = MORI_SORT_INDEX;
+
+void display_actions_menu() {
+  ansi_term_printn("╓─Actions:");
+  ansi_term_printn("║ ╞ l - Lists all saved items");
+  ansi_term_printfn("║ ╞ o - Change the order of the list (by %s)", mori_sort_key_names[list_sort]);
+  ansi_term_printn("║ ╞ s - Search for an item by their name as you type");
+  ansi_term_printn("║ ╞ c - Create new item");
+  ansi_term_printn("║ ╞ d - Delete an existing item");
+  ansi_term_printn("║ ╞ e - Edit existing item");
+  ansi_term_printn("║ ╞ x - Copy url of item or the name if the url is missing");
+  ansi_term_printn("║ ╞ i - Get full info of an item");
+  ansi_term_printn("║ ╘ q - Quit out of program");
+  printf(          "╙──\x1b[32m森\x1b[0m> ");
+  flush();
+}
+
+// Query language:
+// `search --query` queries are whitespace separated terms, all of which have to hold for a tree to match:
+//   name:text  url:text                   substring of the name or url, ignoring ascii case
+//   chapter<N  chapter<=N  chapter>N  chapter>=N  chapter=N  chapter:N  (same for volume)
+//   -term                                 the term must not hold
+// Double quotes keep spaces inside of a term. Every other word is part of the name, bare words are joined
+// with spaces into a single name term. Without --query, and in the TUI, a search is compiled by
+// mori_query_compile_plain() instead: its whole text is one name term, quotes and dashes included, so a
+// plain search never changes meaning because of what it happens to contain. The terms are compiled
+// into a plan that checks the cheapest predicates first: the numeric columns, then names, then urls. A name
+// term of 3 bytes or more is answered by the trigram index when it's built and only its trees are checked.
+typedef enum {
+  // In the order they're evaluated in, cheapest first
+  MORI_FIELD_CHAPTER,
+  MORI_FIELD_VOLUME,
+  MORI_FIELD_NAME,
+  MORI_FIELD_URL,
+} Mori_Query_Field;
+
+typedef enum {
+  MORI_CMP_EQ,
+  MORI_CMP_LT,
+  MORI_CMP_LE,
+  MORI_CMP_GT,
+  MORI_CMP_GE,
+} Mori_Query_Cmp;
+
+typedef struct {
+  Mori_Query_Field field;
+  Mori_Query_Cmp cmp;
+  bool negated;
+  // Already folded for names
+  String_View text;
+  uint32_t number;
+} Mori_Predicate;
+
+typedef struct {
+  Mori_Predicate *items;
+  size_t count;
+  size_t capacity;
+} Mori_Query_Plan;
+
+// Splits off the next term and drops its quotes, the term is copied into ntemp
+bool mori_query_next_term(String_View *text, String_View *term) {
+  *text = sv_trim_left(*text);
+  if (text->count == 0) return false;
+
+  char *dest = ntemp_alloc(text->count);
+  size_t length = 0;
+  bool quoted = false;
+  while (text->count > 0 && (quoted || !isspace((byte_t)text->data[0]))) {
+    char c = text->data[0];
+    sv_chop_left(text, 1);
+    if (c == '"') quoted = !quoted;
+    else dest[length++] = c;
+  }
+  *term = sv_from_parts(dest, length);
+  return true;
+}
+
+bool mori_query_parse_number(String_View text, uint32_t *number) {
+  if (text.count == 0) return false;
+  uint64_t value = 0;
+  for (size_t i = 0; i < text.count; ++i) {
+    if (text.data[i] < '0' || '9' < text.data[i]) return false;
+    value = value*10 + (uint64_t)(text.data[i] - '0');
+    if (value > UINT32_MAX) return false;
+  }
+  *number = (uint32_t)value;
+  return true;
+}
+
+// Parses `chapter>=300` style terms, false when the term is about some other field
+bool mori_query_parse_numeric(String_View term, const char *field_name, Mori_Predicate *predicate, bool *valid) {
+  size_t field_length = strlen(field_name);
+  if (term.count <= field_length || memcmp(term.data, field_name, field_length) != 0) return false;
+  String_View rest = sv_from_parts(term.data + field_length, term.count - field_length);
+
+  if (sv_starts_with(rest, sv_from_cstr("<="))) predicate->cmp = MORI_CMP_LE, sv_chop_left(&rest, 2);
+  else if (sv_starts_with(rest, sv_from_cstr(">="))) predicate->cmp = MORI_CMP_GE, sv_chop_left(&rest, 2);
+  else if (rest.data[0] == '<') predicate->cmp = MORI_CMP_LT, sv_chop_left(&rest, 1);
+  else if (rest.data[0] == '>') predicate->cmp = MORI_CMP_GT, sv_chop_left(&rest, 1);
+  else if (rest.data[0] == '=' || rest.data[0] == ':') predicate->cmp = MORI_CMP_EQ, sv_chop_left(&rest, 1);
+  else return false;
+
+  *valid = mori_query_parse_number(rest, &predicate->number);
+  if (!*valid) nob_log(ERROR, "Expected a number in '"SV_Fmt"'", SV_Arg(term));
+  return true;
+}
+
+bool mori_query_compile(String_View text, Mori_Query_Plan *plan) {
+  String_Builder bare = {0};
+  String_View term = {0};
+  bool valid = true;
+
+  while (valid && mori_query_next_term(&text, &term)) {
+    Mori_Predicate predicate = {0};
+    if (term.count > 1 && term.data[0] == '-') {
+      predicate.negated = true;
+      sv_chop_left(&term, 1);
+    }
+
+    if (mori_query_parse_numeric(term, "chapter", &predicate, &valid)) {
+      predicate.field = MORI_FIELD_CHAPTER;
+    } else if (mori_query_parse_numeric(term, "volume", &predicate, &valid)) {
+      predicate.field = MORI_FIELD_VOLUME;
+    } else if (sv_starts_with(term, sv_from_cstr("name:"))) {
+      predicate.field = MORI_FIELD_NAME;
+      predicate.text = ntemp_sv_fold(sv_from_parts(term.data + 5, term.count - 5));
+    } else if (sv_starts_with(term, sv_from_cstr("url:"))) {
+      predicate.field = MORI_FIELD_URL;
+      predicate.text = sv_from_parts(term.data + 4, term.count - 4);
+    } else if (!predicate.negated) {
+      if (bare.count) da_append(&bare, ' ');
+      sb_append_buf(&bare, term.data, term.count);
+      continue;
+    } else {
+      predicate.field = MORI_FIELD_NAME;
+      predicate.text = ntemp_sv_fold(term);
+    }
+    if (valid) da_append(plan, predicate);
+  }
+
+  if (valid && bare.count) {
+    Mori_Predicate predicate = { .field = MORI_FIELD_NAME };
+    predicate.text = ntemp_sv_fold(sb_to_sv(bare));
+    da_append(plan, predicate);
+  }
+  sb_free(&bare);
+
+  // Stable so terms on the same field keep the order they were written in
+  for (size_t i = 1; i < plan->count; ++i) {
+    Mori_Predicate predicate = plan->items[i];
+    size_t j = i;
+    for (; j > 0 && plan->items[j - 1].field > predicate.field; --j) plan->items[j] = plan->items[j - 1];
+    plan->items[j] = predicate;
+  }
+  return valid;
+}
+
+void mori_query_compile_plain(String_View text, Mori_Query_Plan *plan) {
+  Mori_Predicate predicate = { .field = MORI_FIELD_NAME, .text = ntemp_sv_fold(text) };
+  da_append(plan, predicate);
+}
+
+bool mori_predicate_holds(const Mori_Predicate *predicate, size_t i) {
+  bool holds = false;
+  switch (predicate->field) {
+  case MORI_FIELD_CHAPTER:
+  case MORI_FIELD_VOLUME: {
+    uint32_t value = predicate->field == MORI_FIELD_CHAPTER ? mori_chapter(i) : mori_volume(i);
+    switch (predicate->cmp) {
+    case MORI_CMP_EQ: holds = value == predicate->number; break;
+    case MORI_CMP_LT: holds = value <  predicate->number; break;
+    case MORI_CMP_LE: holds = value <= predicate->number; break;
+    case MORI_CMP_GT: holds = value >  predicate->number; break;
+    case MORI_CMP_GE: holds = value >= predicate->number; break;
+    }
+  } break;
+
+  case MORI_FIELD_NAME:
+    holds = sv_includes_sv(bufsv_to_sv(mori_folded(i)), predicate->text);
+    break;
+
+  case MORI_FIELD_URL:
+    holds = sv_includes_sv_ascii_ignore_case(bufsv_to_sv(mori_url(i)), predicate->text);
+    break;
+  }
+  return holds != predicate->negated;
+}
+
+// Parallel scan:
+// From MORI_PARALLEL_SCAN_MIN_TREES candidates on, the plan is checked by up to nob_nprocs() threads, each over
+// a contiguous partition of the candidates. A worker collects its matches at the start of its own slice of
+// the output, merging them in index order is then just moving the slices together.
+#ifndef MORI_PARALLEL_SCAN_MIN_TREES
+#define MORI_PARALLEL_SCAN_MIN_TREES (128*1024)
+#endif // MORI_PARALLEL_SCAN_MIN_TREES
+
+// Smaller partitions aren't worth a thread
+#define MORI_PARALLEL_SCAN_MIN_PARTITION (32*1024)
+
+typedef struct {
+  const Mori_Query_Plan *plan;
+  // Predicate already answered by the candidates, plan->count when there's none
+  size_t skipped;
+  const uint32_t *candidates;
+  size_t begin;
+  size_t end;
+  uint32_t *matches;
+  size_t found;
+} Mori_Scan_Partition;
+
+void *mori_scan_partition(void *arg) {
+  Mori_Scan_Partition *partition = arg;
+  const Mori_Query_Plan *plan = partition->plan;
+  for (size_t c = partition->begin; c < partition->end; ++c) {
+    size_t i = partition->candidates ? partition->candidates[c] : c;
+    bool holds = true;
+    for (size_t p = 0; p < plan->count && holds; ++p) {
+      if (p != partition->skipped) holds = mori_predicate_holds(&plan->items[p], i);
+    }
+    if (holds) partition->matches[partition->found++] = (uint32_t)i;
   }
-  // TODO: Transform it to an sv and trim it and handle negative sign
-  buf[(size_t)n >= cap ? cap - 1 : (size_t)n] = 0;
+  return NULL;
+}
 
-  if (buf[0] == 'q') return false;
+// Checks the plan against `candidates` (or every tree when NULL) into `matches`, which has room for all of them,
+// split into `workers` partitions
+size_t mori_scan_partitioned(const Mori_Query_Plan *plan, size_t skipped, const uint32_t *candidates, size_t count,
+                             uint32_t *matches, size_t workers) {
+  Mori_Scan_Partition *partitions = ntemp_alloc(workers*sizeof(*partitions));
+  pthread_t *threads = ntemp_alloc(workers*sizeof(*threads));
+  bool *started = ntemp_alloc(workers*sizeof(*started));
+  for (size_t w = 0; w < workers; ++w) {
+    size_t begin = count*w/workers;
+    partitions[w] = (Mori_Scan_Partition) {
+      .plan = plan,
+      .skipped = skipped,
+      .candidates = candidates,
+      .begin = begin,
+      .end = count*(w + 1)/workers,
+      .matches = matches + begin,
+    };
+    // The calling thread takes the last partition, and any a thread couldn't be started for
+    started[w] = w + 1 < workers && pthread_create(&threads[w], NULL, mori_scan_partition, &partitions[w]) == 0;
+  }
 
-  errno = 0;
-  size_t i = (size_t)strtoul(buf, NULL, 10);
-  if (errno != 0) {
-    nob_log(ERROR, "Invalid input: %s", strerror(errno));
-    return false;
+  size_t found = 0;
+  for (size_t w = 0; w < workers; ++w) {
+    if (started[w]) pthread_join(threads[w], NULL);
+    else mori_scan_partition(&partitions[w]);
+    memmove(matches + found, partitions[w].matches, partitions[w].found*sizeof(*matches));
+    found += partitions[w].found;
   }
+  if (workers > 1) nob_log(INFO, "Scanned %zu trees with %zu threads", count, workers);
+  return found;
+}
 
-  *value = i;
-  return true;
+size_t mori_scan(const Mori_Query_Plan *plan, size_t skipped, const uint32_t *candidates, size_t count, uint32_t *matches) {
+  size_t workers = 1;
+  if (count >= MORI_PARALLEL_SCAN_MIN_TREES) {
+    workers = (size_t)nob_nprocs();
+    if (workers > count/MORI_PARALLEL_SCAN_MIN_PARTITION) workers = count/MORI_PARALLEL_SCAN_MIN_PARTITION;
+    if (workers < 1) workers = 1;
+  }
+  return mori_scan_partitioned(plan, skipped, candidates, count, matches, workers);
 }
 
-void display_tree_short(size_t i, const char *prefix) {
-  Mori_Tree *tree = mori.items + i;
-  String_View name = bufsv_to_sv(tree->name);
-  const size_t max_name_char_length = 35;
+// Query result cache:
+// The TUI and scripts keep asking the same few queries. Results are remembered under their compiled plan,
+// so case, quoting and spacing that don't change what a query means share an entry, and are tagged with
+// the mori.generation they were found at. An entry of an older generation is never served.
+#ifndef MORI_QUERY_CACHE_SIZE
+#define MORI_QUERY_CACHE_SIZE 16
+#endif // MORI_QUERY_CACHE_SIZE
 
-  if (!prefix) {
-    ansi_term_printfn("Mori_Tree :: struct {");
-    ansi_term_printfn("  .Index   = %zu;", i);
-    if (tree->name.length > max_name_char_length) {
-      ansi_term_printfn("  .Name    = \"%.*s...\";", max_name_char_length, name.data);
-    } else {
-      ansi_term_printfn("  .Name    = \""SV_Fmt"\";", SV_Arg(name));
+// Results bigger than that are cheaper to find again than to keep around
+#define MORI_QUERY_CACHE_MAX_MATCHES (256*1024)
+
+typedef struct {
+  bool used;
+  String_Builder key;
+  uint64_t generation;
+  uint32_t *matches;
+  size_t found;
+  // Tick of the last time it was stored or hit, the oldest entry is evicted first
+  uint64_t last_used;
+} Mori_Query_Cache_Entry;
+
+typedef struct {
+  Mori_Query_Cache_Entry entries[MORI_QUERY_CACHE_SIZE];
+  uint64_t tick;
+} Mori_Query_Cache;
+
+Mori_Query_Cache query_cache = {0};
+
+// Spells the plan out with every text length prefixed, two plans get the same key only when they're the same
+void mori_query_key(const Mori_Query_Plan *plan, String_Builder *key) {
+  for (size_t p = 0; p < plan->count; ++p) {
+    const Mori_Predicate *predicate = &plan->items[p];
+    sb_appendf(key, "%c%d%d%u:%zu:", predicate->negated ? '-' : '+', predicate->field, predicate->cmp,
+               predicate->number, predicate->text.count);
+    size_t start = key->count;
+    if (predicate->text.count) sb_append_buf(key, predicate->text.data, predicate->text.count);
+    // Urls are matched ignoring ascii case
+    if (predicate->field == MORI_FIELD_URL) {
+      for (size_t k = start; k < key->count; ++k) key->items[k] = (char)tolower((byte_t)key->items[k]);
     }
-    ansi_term_printfn("  .Chapter = %zu;", tree->chapter);
-    ansi_term_printfn("}");
-    return;
   }
+}
 
-  ansi_term_printfn("%sMori_Tree :: struct {", prefix);
-  ansi_term_printfn("%s  .Index   = %zu;", prefix, i);
-  if (tree->name.length > max_name_char_length) {
-    // TODO: Actually split on a space or dash or colon as this can cut mid-word for not so nice views
-    ansi_term_printfn("%s  .Name    = \"%.*s...\";", prefix, max_name_char_length, name.data);
-  } else {
-    ansi_term_printfn("%s  .Name    = \""SV_Fmt"\";", prefix, SV_Arg(name));
+const Mori_Query_Cache_Entry *mori_query_cache_find(String_View key) {
+  for (size_t e = 0; e < MORI_QUERY_CACHE_SIZE; ++e) {
+    Mori_Query_Cache_Entry *entry = &query_cache.entries[e];
+    if (!entry->used || entry->generation != mori.generation || !sv_eq(sb_to_sv(entry->key), key)) continue;
+    entry->last_used = ++query_cache.tick;
+    return entry;
   }
-  ansi_term_printfn("%s  .Chapter = %zu;", prefix, tree->chapter);
-  ansi_term_printfn("%s}", prefix);
+  return NULL;
 }
 
-void display_tree_full(size_t i, const char *prefix) {
-  Mori_Tree *tree = mori.items + i;
-
-  if (!prefix) {
-    ansi_term_printfn("Mori_Tree :: struct {");
-    ansi_term_printfn("  .Index   = %zu;", i);
-    ansi_term_printfn("  .Name    = \""BufSV_Fmt"\";", BufSV_Arg(tree->name));
-    if (tree->url.length == 0 || *(tree->url.buffer->items + tree->url.index) == 0) {
-      ansi_term_printn("  .Url     = None;");
-    } else {
-      ansi_term_printfn("  .Url     = \""BufSV_Fmt"\";", BufSV_Arg(tree->url));
+void mori_query_cache_store(String_View key, const uint32_t *matches, size_t found) {
+  if (found > MORI_QUERY_CACHE_MAX_MATCHES) return;
+
+  // A stale entry of the same query first, then an empty one, then the least recently used one
+  Mori_Query_Cache_Entry *victim = NULL;
+  for (size_t e = 0; e < MORI_QUERY_CACHE_SIZE; ++e) {
+    Mori_Query_Cache_Entry *entry = &query_cache.entries[e];
+    if (entry->used && sv_eq(sb_to_sv(entry->key), key)) {
+      victim = entry;
+      break;
     }
-    ansi_term_printfn("  .Chapter = %zu;", tree->chapter);
-    ansi_term_printfn("  .Volume  = %zu;", tree->volume);
-    ansi_term_printfn("}");
-    return;
+    if (victim && !victim->used) continue;
+    if (!victim || !entry->used || entry->last_used < victim->last_used) victim = entry;
   }
 
-  ansi_term_printfn("%sMori_Tree :: struct {", prefix);
-  ansi_term_printfn("%s  .Index   = %zu;", prefix, i);
-  ansi_term_printfn("%s  .Name    = \""BufSV_Fmt"\";", prefix, BufSV_Arg(tree->name));
-    if (tree->url.length == 0 || *(tree->url.buffer->items + tree->url.index) == 0) {
-      ansi_term_printfn("%s  .Url     = None;", prefix);
-    } else {
-      ansi_term_printfn("%s  .Url     = \""BufSV_Fmt"\";", prefix, BufSV_Arg(tree->url));
-    }
-  ansi_term_printfn("%s  .Chapter = %zu;", prefix, tree->chapter);
-  ansi_term_printfn("%s  .Volume  = %zu;", prefix, tree->volume);
-  ansi_term_printfn("%s}", prefix);
+  free(victim->matches);
+  victim->matches = NULL;
+  if (found) {
+    victim->matches = malloc(found*sizeof(*victim->matches));
+    NOB_ASSERT(victim->matches && "Buy more RAM lol");
+    memcpy(victim->matches, matches, found*sizeof(*matches));
+  }
+  victim->key.count = 0;
+  sb_append_buf(&victim->key, key.data, key.count);
+  victim->used = true;
+  victim->generation = mori.generation;
+  victim->found = found;
+  victim->last_used = ++query_cache.tick;
 }
 
-#define display_mori_tree_short_list() display_mori_tree_short_list_offset(0)
-void display_mori_tree_short_list_offset(size_t offset) {
-  ansi_term_printn("╓─<Your Manga Forest>");
-  for (size_t i = offset; i < mori.count; ++i) {
-    ansi_term_printfn("╟─ Index %zu", i);
-    display_tree_short(i, "║    ");
+void mori_query_cache_free() {
+  for (size_t e = 0; e < MORI_QUERY_CACHE_SIZE; ++e) {
+    sb_free(&query_cache.entries[e].key);
+    free(query_cache.entries[e].matches);
   }
-  ansi_term_printfn("╙─ Mori_Tree mori[%zu];", mori.count);
-  flush();
+  memset(&query_cache, 0, sizeof(query_cache));
 }
 
-void display_mori_tree_full_list() {
-  ansi_term_printn("╓─<Your Manga Forest>");
-  for (size_t i = 0; i < mori.count; ++i) {
-    ansi_term_printfn("╟─ Index %zu", i);
-    display_tree_full(i, "║    ");
+// Puts the indices of the trees matching the query in ntemp, in order. `text` is in the query language when
+// `structured` is set and a plain name search otherwise. False when the query doesn't parse.
+bool mori_run_query(String_View text, bool structured, uint32_t **matches, size_t *found) {
+  Mori_Query_Plan plan = {0};
+  String_Builder key = {0};
+  bool result = true;
+  *matches = NULL;
+  *found = 0;
+  if (!structured) mori_query_compile_plain(text, &plan);
+  else if (!mori_query_compile(text, &plan)) nob_return_defer(false);
+
+  mori_query_key(&plan, &key);
+  const Mori_Query_Cache_Entry *cached = mori_query_cache_find(sb_to_sv(key));
+  if (cached) {
+    nob_log(INFO, "Answered '"SV_Fmt"' from the query cache", SV_Arg(text));
+    *matches = ntemp_alloc((cached->found ? cached->found : 1)*sizeof(**matches));
+    if (cached->found) memcpy(*matches, cached->matches, cached->found*sizeof(**matches));
+    *found = cached->found;
+    nob_return_defer(true);
   }
-  ansi_term_printfn("╙─ Mori_Tree mori[%zu];", mori.count);
-  flush();
+  mori_fold_names();
+
+  // The longest positive name term is the most selective one to get candidates from
+  size_t indexed = plan.count;
+  if (trigrams.ready) {
+    for (size_t p = 0; p < plan.count; ++p) {
+      const Mori_Predicate *predicate = &plan.items[p];
+      if (predicate->field != MORI_FIELD_NAME || predicate->negated || predicate->text.count < 3) continue;
+      if (indexed == plan.count || predicate->text.count > plan.items[indexed].text.count) indexed = p;
+    }
+  }
+
+  uint32_t *candidates = NULL;
+  size_t candidates_count = 0;
+  if (indexed < plan.count) {
+    candidates_count = mori_search_names(plan.items[indexed].text, &candidates);
+  } else {
+    candidates_count = mori.count;
+  }
+
+  *matches = ntemp_alloc((candidates_count ? candidates_count : 1)*sizeof(**matches));
+  *found = mori_scan(&plan, indexed, candidates, candidates_count, *matches);
+  mori_query_cache_store(sb_to_sv(key), *matches, *found);
+
+defer:
+  sb_free(&key);
+  da_free(plan);
+  return result;
 }
 
-#define GLOBAL_CMD_INIT_CAP 16
-Nob_Cmd cmd = {0};
+#define MORI_LIVE_SEARCH_ROWS 15
 
-void display_actions_menu() {
-  ansi_term_printn("╓─Actions:");
-  ansi_term_printn("║ ╞ l - Lists all saved items");
-  ansi_term_printn("║ ╞ s - Search for an item by their name");
-  ansi_term_printn("║ ╞ c - Create new item");
-  ansi_term_printn("║ ╞ d - Delete an existing item");
-  ansi_term_printn("║ ╞ e - Edit existing item");
-  ansi_term_printn("║ ╞ x - Copy url of item or the name if the url is missing");
-  ansi_term_printn("║ ╞ i - Get full info of an item");
-  ansi_term_printn("║ ╘ q - Quit out of program");
-  printf(          "╙──\x1b[32m森\x1b[0m> ");
-  flush();
+// Search-as-you-type: every keystroke looks the query up in the prefix index and redraws the first trees
+// with a word starting with it. Enter hands the query over to the full substring search, escape gives up.
+bool live_search(String_Builder *query) {
+  mori_prefix_build();
+  while (true) {
+    Ntemp_Checkpoint save_point = ntemp_save();
+    String_View prefix = ntemp_sv_fold(sb_to_sv(*query));
+    uint32_t *matches = NULL;
+    size_t found = prefix.count ? mori_prefix_lookup(prefix, &matches) : 0;
+
+    ansi_term_clear_screen();
+    ansi_term_printn("╓<Search_As_You_Type>");
+    for (size_t m = 0; m < found && m < MORI_LIVE_SEARCH_ROWS; ++m) {
+      ansi_term_printfn("╟─ Index %-7u "BufSV_Fmt, matches[m], BufSV_Arg(mori_name(matches[m])));
+    }
+    if (found > MORI_LIVE_SEARCH_ROWS) ansi_term_printfn("╟─ ... and %zu more", found - MORI_LIVE_SEARCH_ROWS);
+    ansi_term_printfn("╙ Mori_Tree found[%zu]; (enter: full search, esc: cancel)", found);
+    printf("Search :: %.*s", (int)query->count, query->count ? query->items : "");
+    flush();
+    ntemp_rewind(save_point);
+
+    int key = ansi_term_read_key();
+    switch (key) {
+    case -1:
+    case ANSI_TERM_KEY_ESCAPE:
+      return false;
+
+    case '\r':
+    case '\n':
+      return true;
+
+    case ANSI_TERM_KEY_BACKSPACE:
+    case '\b':
+      // Drops a whole utf-8 sequence, continuation bytes first
+      while (query->count && ((byte_t)query->items[query->count - 1] & 0xC0) == 0x80) query->count--;
+      if (query->count) query->count--;
+      break;
+
+    case ANSI_TERM_KEY_CTRL('u'):
+      query->count = 0;
+      break;
+
+    case ANSI_TERM_KEY_SEQUENCE:
+      // Arrows and the like don't do anything here, but they mustn't cancel or end up in the query
+      break;
+
+    default:
+      if (key >= ' ') da_append(query, (char)key);
+      break;
+    }
+  }
 }
 
-bool handle_action(String_Builder *sb, char action) {
+bool handle_action(char action) {
   switch (action) {
   case 'q':
     return true;
@@ -424,7 +2717,8 @@ bool handle_action(String_Builder *sb, char action) {
 
       nob_log(INFO, "Chopping tree %zu", i);
 
-      list_remove(&mori, i);
+      mori_delete_tree(i);
+      journal_append(MORI_JOURNAL_DELETE, i);
     } break;
 
     case 'x': {
@@ -438,24 +2732,24 @@ bool handle_action(String_Builder *sb, char action) {
 	break;
       }
 
-      Mori_Tree *tree = mori.items + i;
+      Mori_Tree tree = mori_get(i);
       size_t save_point = nob_temp_save();
       bool ok, url;
-      if (tree->url.length) {
+      if (tree.url.length) {
 	url = true;
-	cmd_append(&cmd, "wl-copy", nob_temp_sprintf(BufSV_Fmt, BufSV_Arg(tree->url)));
+	cmd_append(&cmd, "wl-copy", nob_temp_sprintf(BufSV_Fmt, BufSV_Arg(tree.url)));
 	ok = cmd_run(&cmd);
       } else {
 	url = false;
-	cmd_append(&cmd, "wl-copy", nob_temp_sprintf(BufSV_Fmt, BufSV_Arg(tree->name)));
+	cmd_append(&cmd, "wl-copy", nob_temp_sprintf(BufSV_Fmt, BufSV_Arg(tree.name)));
 	ok = cmd_run(&cmd);
       }
       nob_temp_rewind(save_point);
 
       if (ok) {
-	nob_log(INFO, "Copied %s for "BufSV_Fmt, url ? "url" : "name", BufSV_Arg(tree->name));
+	nob_log(INFO, "Copied %s for "BufSV_Fmt, url ? "url" : "name", BufSV_Arg(tree.name));
       } else {
-	nob_log(ERROR, "Failed to copy %s for "BufSV_Fmt, url ? "url" : "name", BufSV_Arg(tree->name));
+	nob_log(ERROR, "Failed to copy %s for "BufSV_Fmt, url ? "url" : "name", BufSV_Arg(tree.name));
       }
     } break;
 
@@ -475,20 +2769,27 @@ bool handle_action(String_Builder *sb, char action) {
 	break;
       }
       trimmed = sv_trim((String_View) { .count = n, .data = buf });
-      size_t buffer_index = sb->count;
-      sb_append_buf(sb, trimmed.data, trimmed.count);
-      tree.name = (Buffered_String_View) { .buffer = sb, .index = buffer_index, .length = trimmed.count, };
+      tree.name = mori_heap_push(trimmed);
 
       printf("Url :: ");
       flush();
       n = read(STDIN_FILENO, buf, cap) - 1;
       if (n > 0) {
 	trimmed = sv_trim((String_View) { .count = n, .data = buf });
-	buffer_index = sb->count;
-	sb_append_buf(sb, trimmed.data, trimmed.count);
-	tree.url = (Buffered_String_View) { .buffer = sb, .index = buffer_index, .length = trimmed.count, };
+	tree.url = mori_heap_push(trimmed);
+      } else {
+	tree.url = mori_heap_push((String_View){0});
       }
 
+      // Only a warning, the same series is sometimes tracked twice on purpose
+      Ntemp_Checkpoint save_point = ntemp_save();
+      uint32_t *same = NULL;
+      size_t same_count = mori_exact_lookup(MORI_EXACT_NAME, ntemp_sv_fold(bufsv_to_sv(tree.name)), &same);
+      for (size_t m = 0; m < same_count; ++m) nob_log(WARNING, "Tree %u already has this name", same[m]);
+      same_count = mori_exact_lookup(MORI_EXACT_URL, bufsv_to_sv(tree.url), &same);
+      for (size_t m = 0; m < same_count; ++m) nob_log(WARNING, "Tree %u already has this url", same[m]);
+      ntemp_rewind(save_point);
+
       printf("Chapter :: ");
       flush();
       n = read(STDIN_FILENO, buf, cap);
@@ -505,7 +2806,8 @@ bool handle_action(String_Builder *sb, char action) {
 	tree.volume = 1;
       }
 
-      da_append(&mori, tree);
+      mori_append(tree);
+      journal_append(MORI_JOURNAL_CREATE, mori.count - 1);
     } break;
 
     case 'e': {
@@ -518,8 +2820,8 @@ bool handle_action(String_Builder *sb, char action) {
 	break;
       }
 
-      Mori_Tree *tree = mori.items + i;
       size_t save_point = nob_temp_save();
+      Ntemp_Checkpoint ntemp_point = ntemp_save();
       String_View read_data = {0}, trimmed = {0};
       char *last_error = NULL;
       bool is_editing = true;
@@ -531,6 +2833,7 @@ bool handle_action(String_Builder *sb, char action) {
 	  last_error = NULL;
 	}
 	nob_temp_rewind(save_point);
+	ntemp_rewind(ntemp_point);
 	if (read_data.data) {
 	  free((void*)read_data.data);
 	  read_data.data = NULL;
@@ -538,6 +2841,7 @@ bool handle_action(String_Builder *sb, char action) {
 	}
 
 	display_tree_full(i, NULL);
+	ansi_term_frame_flush();
 	printf("Edit_Field_Name = ");
 	flush();
 
@@ -569,18 +2873,9 @@ bool handle_action(String_Builder *sb, char action) {
 	  trimmed = sv_trim(read_data);
 
 	  if (trimmed.count) {
-	    if (trimmed.count <= tree->name.length) {
-	      for (size_t i = 0; i < trimmed.count; ++i) {
-		tree->name.buffer->items[tree->name.index + i] = trimmed.data[i];
-	      }
-	      for (size_t i = trimmed.count; i < tree->name.length; ++i) {
-		tree->name.buffer->items[tree->name.index + i] = 0;
-	      }
-	    } else {
-	      size_t buffer_index = sb->count;
-	      sb_append_buf(sb, trimmed.data, trimmed.count);
-	      tree->name = (Buffered_String_View){ .buffer = sb, .index = buffer_index, .length = trimmed.count };
-	    }
+	    mori_heap_set(&mori_name(i), trimmed);
+	    mori_edited(i, true);
+	    journal_append(MORI_JOURNAL_SET, i);
 	  }
 
 	  continue;
@@ -596,21 +2891,10 @@ bool handle_action(String_Builder *sb, char action) {
 	  }
 
 	  trimmed = sv_trim(read_data);
-	  if (trimmed.count) {
-	    if (trimmed.count <= tree->url.length) {
-	      for (size_t i = 0; i < trimmed.count; ++i) {
-		tree->url.buffer->items[tree->url.index + i] = trimmed.data[i];
-	      }
-	      for (size_t i = trimmed.count; i < tree->url.length; ++i) {
-		tree->url.buffer->items[tree->url.index + i] = 0;
-	      }
-	    } else {
-	      size_t buffer_index = sb->count;
-	      sb_append_buf(sb, trimmed.data, trimmed.count);
-	      tree->url = (Buffered_String_View){ .buffer = sb, .index = buffer_index, .length = trimmed.count };
-	    }
-	  } else if (tree->url.length > 0) {
-	    memset(tree->url.buffer->items + tree->url.index, 0, tree->url.length);
+	  if (trimmed.count || mori_url(i).length > 0) {
+	    mori_heap_set(&mori_url(i), trimmed);
+	    mori_edited(i, false);
+	    journal_append(MORI_JOURNAL_SET, i);
 	  }
 
 	  continue;
@@ -635,7 +2919,9 @@ bool handle_action(String_Builder *sb, char action) {
 	      continue;
 	    }
 
-	    tree->chapter = chapter;
+	    mori_chapter(i) = chapter;
+	    mori_edited(i, false);
+	    journal_append(MORI_JOURNAL_SET, i);
 	  }
 
 	  continue;
@@ -661,7 +2947,9 @@ bool handle_action(String_Builder *sb, char action) {
 	      continue;
 	    }
 
-	    tree->volume = volume;
+	    mori_volume(i) = volume;
+	    mori_edited(i, false);
+	    journal_append(MORI_JOURNAL_SET, i);
 	  }
 
 	  continue;
@@ -670,12 +2958,19 @@ bool handle_action(String_Builder *sb, char action) {
 	last_error = nob_temp_sprintf("Unknown field: %s", field);
       }
       nob_temp_rewind(save_point);
+      ntemp_rewind(ntemp_point);
       
     } break;
 
     case 'l': {
       ansi_term_clear_screen();
-      display_mori_tree_short_list();
+      display_mori_tree_short_list(list_sort);
+    } break;
+
+    case 'o': {
+      list_sort = (list_sort + 1) % MORI_SORT_COUNT;
+      ansi_term_clear_screen();
+      display_mori_tree_short_list(list_sort);
     } break;
 
     case 'i': {
@@ -689,35 +2984,48 @@ bool handle_action(String_Builder *sb, char action) {
       }
 
       display_tree_full(i, NULL);
+      ansi_term_frame_flush();
     } break;
 
   case 's': {
     ansi_term_clear_screen();
 
-    String_View sv = {0};
+    String_Builder query = {0};
+    if (ansi_term_raw_start()) {
+      bool submitted = live_search(&query);
+      ansi_term_raw_end();
+      ansi_term_clear_screen();
+      if (!submitted) {
+        sb_free(&query);
+        return false;
+      }
+    } else {
+      // Not a terminal, the query comes in as a whole line
+      String_View line = {0};
+      if (!ansi_term_read_line(&line)) break;
+      sb_append_buf(&query, line.data, line.count);
+      NOB_FREE(line.data);
+    }
 
-    if (!ansi_term_read_line(&sv)) {
+    Ntemp_Checkpoint save_point = ntemp_save();
+    uint32_t *matches = NULL;
+    size_t found = 0;
+    if (!mori_run_query(sv_trim(sb_to_sv(query)), false, &matches, &found)) {
+      sb_free(&query);
+      ntemp_rewind(save_point);
       break;
     }
-    size_t save_point = temp_save();
-    const char *search = ntemp_sv_ascii_to_lower(sv_trim(sv));
-    size_t found = 0;
-    ansi_term_printn("╓<Search_Results>");
-    for (size_t i = 0; i < mori.count; ++i) {
-      Mori_Tree *tree = mori.items + i;
-      const char *lowered_name = ntemp_sv_ascii_to_lower(bufsv_to_sv(tree->name));
-      if (zstr_includes_zstr(lowered_name, search)) {
-	ansi_term_printfn("╟──◈ Index %zu", i);
-	display_tree_short(i, "║      ");
-	found++;
-      }
+    frame_line("", "╓<Search_Results>");
+    for (size_t m = 0; m < found; ++m) {
+      frame_tree_heading("╟──◈ Index ", matches[m]);
+      display_tree_short(matches[m], "║      ");
     }
+    frame_list_end("╙ Mori_Tree found[", found);
+    ansi_term_frame_flush();
 
     // Free memory
-    NOB_FREE(sv.data);
-    temp_rewind(save_point);
-
-    ansi_term_printfn("╙ Mori_Tree found[%zu];", found);
+    sb_free(&query);
+    ntemp_rewind(save_point);
   } break;
 
   case ' ':
@@ -736,18 +3044,471 @@ bool handle_action(String_Builder *sb, char action) {
   return false;
 }
 
-bool load_morimori_file(String_Builder *sb, const char *file_path) {
+// Fuzzy search:
+// Ranks every folded name by the edit distance of the query to its closest substring, computed with Myers'
+// bit-parallel algorithm: one machine word holds a whole column of the distance matrix so each name costs
+// a handful of bit operations per byte. Only the best `top` trees are kept, in a bounded max heap whose
+// root is the worst match kept so far.
+#define MORI_FUZZY_MAX_QUERY 64
+#define MORI_FUZZY_DEFAULT_TOP 10
+
+typedef struct {
+  uint32_t index;
+  uint32_t distance;
+} Mori_Fuzzy_Match;
+
+// Edit distance of the query to the closest substring of `text`, `peq` has bit j set for each byte that
+// equals byte j of the query
+uint32_t myers_substring_distance(const uint64_t peq[256], size_t query_length, String_View text) {
+  uint64_t last = (uint64_t)1 << (query_length - 1);
+  uint64_t pv = ~(uint64_t)0, mv = 0;
+  uint32_t score = (uint32_t)query_length, best = score;
+  for (size_t i = 0; i < text.count && best > 0; ++i) {
+    uint64_t eq = peq[(byte_t)text.data[i]];
+    uint64_t xv = eq | mv;
+    uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+    uint64_t ph = mv | ~(xh | pv);
+    uint64_t mh = pv & xh;
+    if (ph & last) score++;
+    else if (mh & last) score--;
+    // The match may start anywhere in the text so nothing is carried into the first row
+    ph <<= 1;
+    mh <<= 1;
+    pv = mh | ~(xv | ph);
+    mv = ph & xv;
+    if (score < best) best = score;
+  }
+  return best;
+}
+
+bool mori_fuzzy_worse(Mori_Fuzzy_Match a, Mori_Fuzzy_Match b) {
+  return a.distance != b.distance ? a.distance > b.distance : a.index > b.index;
+}
+
+void mori_fuzzy_sift_down(Mori_Fuzzy_Match *heap, size_t count, size_t at) {
+  while (true) {
+    size_t worst = at, left = 2*at + 1, right = 2*at + 2;
+    if (left < count && mori_fuzzy_worse(heap[left], heap[worst])) worst = left;
+    if (right < count && mori_fuzzy_worse(heap[right], heap[worst])) worst = right;
+    if (worst == at) return;
+    Mori_Fuzzy_Match tmp = heap[at];
+    heap[at] = heap[worst];
+    heap[worst] = tmp;
+    at = worst;
+  }
+}
+
+void mori_fuzzy_sift_up(Mori_Fuzzy_Match *heap, size_t at) {
+  while (at > 0 && mori_fuzzy_worse(heap[at], heap[(at - 1)/2])) {
+    Mori_Fuzzy_Match tmp = heap[at];
+    heap[at] = heap[(at - 1)/2];
+    heap[(at - 1)/2] = tmp;
+    at = (at - 1)/2;
+  }
+}
+
+// Puts the best `top` matches for the folded `query` in ntemp, best first, and returns how many there are.
+// Names that share nothing with the query (distance of the whole query) are never a match.
+size_t mori_fuzzy_search_names(String_View query, size_t top, Mori_Fuzzy_Match **matches) {
+  *matches = NULL;
+  if (query.count == 0 || top == 0) return 0;
+  if (query.count > MORI_FUZZY_MAX_QUERY) {
+    nob_log(WARNING, "Fuzzy search only looks at the first %d bytes of the query", MORI_FUZZY_MAX_QUERY);
+    query.count = MORI_FUZZY_MAX_QUERY;
+  }
+  mori_fold_names();
+
+  uint64_t peq[256] = {0};
+  for (size_t j = 0; j < query.count; ++j) peq[(byte_t)query.data[j]] |= (uint64_t)1 << j;
+
+  if (top > mori.count) top = mori.count;
+  Mori_Fuzzy_Match *heap = ntemp_alloc((top ? top : 1)*sizeof(*heap));
+  size_t count = 0;
+  for (size_t i = 0; i < mori.count; ++i) {
+    Mori_Fuzzy_Match match = { .index = (uint32_t)i };
+    match.distance = myers_substring_distance(peq, query.count, bufsv_to_sv(mori_folded(i)));
+    if (match.distance >= query.count) continue;
+    if (count < top) {
+      heap[count++] = match;
+      mori_fuzzy_sift_up(heap, count - 1);
+    } else if (mori_fuzzy_worse(heap[0], match)) {
+      heap[0] = match;
+      mori_fuzzy_sift_down(heap, count, 0);
+    }
+  }
+
+  // Popping the worst match each time fills the array from the back
+  for (size_t left = count; left > 1; --left) {
+    Mori_Fuzzy_Match worst = heap[0];
+    heap[0] = heap[left - 1];
+    heap[left - 1] = worst;
+    mori_fuzzy_sift_down(heap, left - 1, 0);
+  }
+  *matches = heap;
+  return count;
+}
+
+// Near-duplicates:
+// `mori dedupe` groups trees that are likely the same series. Names are compared by the byte trigrams of their
+// folded name with every run of separators made a single space, which MinHash sums up in MORI_DEDUPE_HASHES
+// minimums. Cut into bands of MORI_DEDUPE_ROWS, two names that share any band are candidates; that's likely
+// past a similarity of about (1/bands)^(1/rows) and unlikely below it. Urls only differing in scheme, `www.`,
+// ascii case or trailing slashes count as one key of their own. Trees are sorted by key so candidates end up
+// next to each other, each one is checked against the first tree of its run and the pairs that really are
+// alike are merged with union-find. That's linear in the number of trees, no pair of trees is ever enumerated.
+#define MORI_DEDUPE_HASHES 16
+#define MORI_DEDUPE_ROWS 2
+#define MORI_DEDUPE_BANDS (MORI_DEDUPE_HASHES/MORI_DEDUPE_ROWS)
+// Jaccard similarity of the trigrams two names need to be duplicates
+#define MORI_DEDUPE_MIN_SIMILARITY 0.5
+
+// Murmur3's finalizer
+uint32_t mori_mix32(uint32_t h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+String_View ntemp_url_normalize(String_View url) {
+  char *dest = ntemp_alloc(url.count + 1);
+  for (size_t k = 0; k < url.count; ++k) dest[k] = (char)tolower((byte_t)url.data[k]);
+  String_View normalized = sv_from_parts(dest, url.count);
+  if (sv_starts_with(normalized, sv_from_cstr("https://"))) sv_chop_left(&normalized, 8);
+  else if (sv_starts_with(normalized, sv_from_cstr("http://"))) sv_chop_left(&normalized, 7);
+  if (sv_starts_with(normalized, sv_from_cstr("www."))) sv_chop_left(&normalized, 4);
+  while (normalized.count > 0 && normalized.data[normalized.count - 1] == '/') normalized.count--;
+  return normalized;
+}
+
+// Writes the hashes of the trigrams of tree `i`'s name to `shingles`, sorted and without repeats, and returns
+// how many there are. Names shorter than a trigram are a single one. `shingles` has room for a hash per byte
+// of the folded name plus one.
+size_t mori_dedupe_shingles(size_t i, uint32_t *shingles) {
+  Ntemp_Checkpoint save_point = ntemp_save();
+  String_View folded = bufsv_trim_zero_padding(mori_folded(i));
+  char *words = ntemp_alloc(folded.count + 1);
+  size_t length = 0;
+  for (size_t k = 0; k < folded.count; ++k) {
+    if (!mori_is_word_separator(folded.data[k])) words[length++] = folded.data[k];
+    else if (length > 0 && words[length - 1] != ' ') words[length++] = ' ';
+  }
+  if (length > 0 && words[length - 1] == ' ') length--;
+
+  size_t count = 0;
+  if (0 < length && length < 3) {
+    shingles[count++] = mori_exact_hash(MORI_EXACT_NAME, sv_from_parts(words, length));
+  }
+  for (size_t k = 0; length >= 3 && k + 3 <= length; ++k) {
+    uint32_t shingle = mori_mix32((uint32_t)(byte_t)words[k] << 16 | (uint32_t)(byte_t)words[k + 1] << 8 | (byte_t)words[k + 2]);
+    size_t at = count++;
+    for (; at > 0 && shingles[at - 1] > shingle; --at) shingles[at] = shingles[at - 1];
+    shingles[at] = shingle;
+  }
+  ntemp_rewind(save_point);
+
+  size_t unique = count ? 1 : 0;
+  for (size_t k = 1; k < count; ++k) {
+    if (shingles[k] != shingles[unique - 1]) shingles[unique++] = shingles[k];
+  }
+  return unique;
+}
+
+typedef struct {
+  // Trigrams of every name one after the other, tree `i`'s end at ends[i]
+  uint32_t *shingles;
+  uint32_t *ends;
+  // Hash of every normalized url, 0 for trees without one
+  uint32_t *urls;
+} Mori_Dedupe_Sets;
+
+bool mori_dedupe_alike(const Mori_Dedupe_Sets *sets, size_t a, size_t b) {
+  if (sets->urls[a] && sets->urls[a] == sets->urls[b]) {
+    Ntemp_Checkpoint save_point = ntemp_save();
+    bool same = sv_eq(ntemp_url_normalize(bufsv_trim_zero_padding(mori_url(a))),
+                      ntemp_url_normalize(bufsv_trim_zero_padding(mori_url(b))));
+    ntemp_rewind(save_point);
+    if (same) return true;
+  }
+
+  const uint32_t *x = sets->shingles + (a ? sets->ends[a - 1] : 0), *x_end = sets->shingles + sets->ends[a];
+  const uint32_t *y = sets->shingles + (b ? sets->ends[b - 1] : 0), *y_end = sets->shingles + sets->ends[b];
+  size_t all = (size_t)(x_end - x) + (size_t)(y_end - y), shared = 0;
+  while (x < x_end && y < y_end) {
+    if (*x == *y) shared++, x++, y++;
+    else if (*x < *y) x++;
+    else y++;
+  }
+  all -= shared;
+  return all > 0 && (double)shared >= MORI_DEDUPE_MIN_SIMILARITY*(double)all;
+}
+
+uint32_t mori_union_find(uint32_t *parents, uint32_t i) {
+  while (parents[i] != i) {
+    parents[i] = parents[parents[i]];
+    i = parents[i];
+  }
+  return i;
+}
+
+// Finds the groups of near-duplicate trees, `groups` gets the members of every group one after the other with
+// `groups_ends` marking where each ends, both in ntemp. Groups and their members are in index order.
+size_t mori_dedupe(uint32_t **groups, uint32_t **groups_ends) {
+  mori_fold_names();
+  size_t slots = mori.count ? mori.count : 1;
+  Mori_Dedupe_Sets sets = {
+    .ends = ntemp_alloc(slots*sizeof(*sets.ends)),
+    .urls = ntemp_alloc(slots*sizeof(*sets.urls)),
+  };
+  size_t shingles_capacity = 0;
+  for (size_t i = 0; i < mori.count; ++i) shingles_capacity += mori_folded(i).length + 1;
+  sets.shingles = ntemp_alloc((shingles_capacity ? shingles_capacity : 1)*sizeof(*sets.shingles));
+
+  size_t keys_per_tree = MORI_DEDUPE_BANDS + 1;
+  uint32_t *trees = ntemp_alloc(slots*keys_per_tree*sizeof(*trees));
+  uint64_t *keys = ntemp_alloc(slots*keys_per_tree*sizeof(*keys));
+  size_t count = 0, shingles_count = 0;
+
+  uint32_t seeds[MORI_DEDUPE_HASHES];
+  for (size_t h = 0; h < MORI_DEDUPE_HASHES; ++h) seeds[h] = mori_mix32((uint32_t)h*0x9e3779b9u + 1);
+
+  for (size_t i = 0; i < mori.count; ++i) {
+    uint32_t *shingles = sets.shingles + shingles_count;
+    size_t tree_shingles = mori_dedupe_shingles(i, shingles);
+    shingles_count += tree_shingles;
+    sets.ends[i] = (uint32_t)shingles_count;
+    if (tree_shingles) {
+      uint32_t signature[MORI_DEDUPE_HASHES];
+      for (size_t h = 0; h < MORI_DEDUPE_HASHES; ++h) {
+        signature[h] = UINT32_MAX;
+        for (size_t s = 0; s < tree_shingles; ++s) {
+          uint32_t hashed = mori_mix32(shingles[s] ^ seeds[h]);
+          if (hashed < signature[h]) signature[h] = hashed;
+        }
+      }
+      for (size_t band = 0; band < MORI_DEDUPE_BANDS; ++band) {
+        uint32_t key = mori_mix32((uint32_t)band + 1);
+        for (size_t row = 0; row < MORI_DEDUPE_ROWS; ++row) key = mori_mix32(key ^ signature[band*MORI_DEDUPE_ROWS + row]);
+        trees[count] = (uint32_t)i;
+        keys[count++] = key;
+      }
+    }
+
+    Ntemp_Checkpoint save_point = ntemp_save();
+    String_View url = ntemp_url_normalize(bufsv_trim_zero_padding(mori_url(i)));
+    sets.urls[i] = url.count ? mori_exact_hash(MORI_EXACT_URL, url) | 1 : 0;
+    ntemp_rewind(save_point);
+    if (sets.urls[i]) {
+      trees[count] = (uint32_t)i;
+      keys[count++] = sets.urls[i];
+    }
+  }
+  mori_radix_sort(trees, keys, count, sizeof(uint32_t));
+
+  uint32_t *parents = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(*parents));
+  uint32_t *sizes = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(*sizes));
+  for (size_t i = 0; i < mori.count; ++i) parents[i] = (uint32_t)i, sizes[i] = 1;
+  for (size_t run = 0, end = 0; run < count; run = end) {
+    for (end = run + 1; end < count && keys[end] == keys[run]; ++end) {
+      uint32_t a = mori_union_find(parents, trees[run]), b = mori_union_find(parents, trees[end]);
+      if (a == b || !mori_dedupe_alike(&sets, trees[run], trees[end])) continue;
+      if (sizes[a] < sizes[b]) {
+        uint32_t smaller = a;
+        a = b;
+        b = smaller;
+      }
+      parents[b] = a;
+      sizes[a] += sizes[b];
+    }
+  }
+
+  // Chaining every tree to the next one of its group lists each group from its first tree on
+  uint32_t *firsts = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(*firsts));
+  uint32_t *nexts = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(*nexts));
+  memset(firsts, 0xFF, mori.count*sizeof(*firsts));
+  for (size_t i = mori.count; i-- > 0;) {
+    uint32_t root = mori_union_find(parents, (uint32_t)i);
+    nexts[i] = firsts[root];
+    firsts[root] = (uint32_t)i;
+  }
+
+  size_t groups_count = 0, members = 0;
+  *groups = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(**groups));
+  *groups_ends = ntemp_alloc((mori.count ? mori.count : 1)*sizeof(**groups_ends));
+  for (size_t i = 0; i < mori.count; ++i) {
+    uint32_t root = mori_union_find(parents, (uint32_t)i);
+    if (sizes[root] < 2 || firsts[root] != i) continue;
+    for (uint32_t member = (uint32_t)i; member != UINT32_MAX; member = nexts[member]) (*groups)[members++] = member;
+    (*groups_ends)[groups_count++] = (uint32_t)members;
+  }
+  return groups_count;
+}
+
+// Loads the snapshot and replays the journal on top of it, the journal lock must be held already
+bool load_morimori_locked(String_Builder *sb, const char *file_path) {
   nob_log(INFO, "Checking for morimori file '%s'...", file_path);
   if (!nob_file_exists(file_path)) {
-    if (!write_entire_file(file_path, mori_header, MORI_HEADER_SIZE)) return false;
+    if (!write_morimori_file(file_path, NULL)) return false;
     nob_log(INFO, "Created base morimori file!");
-    return true;
+  } else if (!read_morimori_file(sb, file_path)) {
+    return false;
+  }
+
+  size_t valid_size = 0;
+  if (!replay_journal(journal.path, &valid_size)) return false;
+  mori_fold_names();
+  return start_journal(valid_size);
+}
+
+bool load_morimori_file(String_Builder *sb, const char *file_path) {
+  if (!open_journal(file_path, -1)) return false;
+  return load_morimori_locked(sb, file_path);
+}
+
+// Read-only counterpart of load_morimori_file, a missing file is just an empty forest
+bool open_morimori_file_read_only(String_Builder *sb, const char *file_path) {
+  nob_log(INFO, "Checking for morimori file '%s'...", file_path);
+  if (!nob_file_exists(file_path)) return true;
+
+  if (!map_morimori_file(sb, file_path)) return false;
+  size_t valid_size = 0;
+  return replay_journal(get_journal_file_path(file_path), &valid_size);
+}
+
+bool parse_index(const char *arg, size_t *index) {
+  if (*arg == 0) return false;
+  for (const char *c = arg; *c; ++c) if (*c < '0' || '9' < *c) return false;
+  errno = 0;
+  *index = (size_t)strtoull(arg, NULL, 10);
+  return errno == 0;
+}
+
+// Resolves `mori bump` targets: either an index or the name of exactly one tree (ignoring ascii case)
+bool find_tree_index(String_Builder *buffer, const Mori_V1_Header *header, size_t count, const char *target, size_t *index) {
+  if (parse_index(target, index)) {
+    if (*index < count) return true;
+    nob_log(ERROR, "OutOfBounds: Trying to access index %zu in list of length %zu", *index, count);
+    return false;
+  }
+
+  String_View name = sv_from_cstr(target);
+  size_t found = 0;
+  for (size_t i = 0; i < count; ++i) {
+    Mori_Tree tree = {0};
+    if (header) {
+      if (!get_v1_mori_tree(buffer, header, i, &tree, NULL)) return false;
+    } else {
+      tree = mori_get(i);
+    }
+    String_View tree_name = sv_from_parts(buffer->items + tree.name.index, tree.name.length);
+    if (!tree.name.length || !sv_eq_ascii_ignore_case(tree_name, name)) continue;
+    if (found++ == 0) *index = i;
+    else nob_log(ERROR, "'%s' is both tree %zu and tree %zu, bump it by index instead", target, *index, i);
+  }
+  if (found == 0) nob_log(ERROR, "No tree is called '%s'", target);
+  return found == 1;
+}
+
+// Counts `value` up by one, unless that would wrap it around to 0
+bool bump_value(size_t index, bool volume, uint32_t *value) {
+  if (*value == UINT32_MAX) {
+    nob_log(ERROR, "Mori_Tree[%zu].%s is already at %u, it can't go any higher", index, volume ? "volume" : "chapter", *value);
+    return false;
+  }
+  *value += 1;
+  return true;
+}
+
+typedef enum {
+  BUMP_DONE,
+  BUMP_FAILED,
+  BUMP_NEEDS_LOAD,
+} Bump_Result;
+
+// `mori bump` fast path: the counters of a v1 record live at a fixed offset so they're bumped with a
+// single pwrite while holding the journal lock, the forest is never loaded. A v0 file or a journal with
+// pending records can't take this path and BUMP_NEEDS_LOAD is returned.
+Bump_Result bump_tree_in_place(const char *file_path, const char *target, bool volume) {
+  Bump_Result result = BUMP_DONE;
+  void *bytes = MAP_FAILED;
+  struct stat st = {0};
+
+  int fd = open(file_path, O_RDWR);
+  if (fd < 0) return BUMP_NEEDS_LOAD;
+
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < MORI_V1_MIN_HEADER_SIZE) nob_return_defer(BUMP_NEEDS_LOAD);
+  bytes = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (bytes == MAP_FAILED) nob_return_defer(BUMP_NEEDS_LOAD);
+
+  String_Builder buffer = { .items = bytes, .count = (size_t)st.st_size };
+  Mori_V1_Header header = {0};
+  if (memcmp(buffer.items, mori_header, MORI_HEADER_SIZE) != 0) nob_return_defer(BUMP_NEEDS_LOAD);
+  if (!read_mori_v1_header(&buffer, &header)) nob_return_defer(BUMP_FAILED);
+
+  // Anything after the header of a journal tied to this snapshot are edits the file doesn't have yet
+  struct stat journal_st = {0};
+  Mori_Journal_Header journal_header = {0};
+  if (fstat(journal.fd, &journal_st) < 0) nob_return_defer(BUMP_NEEDS_LOAD);
+  if ((size_t)journal_st.st_size > sizeof(journal_header) &&
+      pread(journal.fd, &journal_header, sizeof(journal_header), 0) == sizeof(journal_header) &&
+      memcmp(journal_header.magic, MORI_JOURNAL_MAGIC, 4) == 0 &&
+      journal_header.snapshot_id == header.snapshot_id) {
+    nob_return_defer(BUMP_NEEDS_LOAD);
+  }
+
+  size_t index = 0;
+  if (!find_tree_index(&buffer, &header, header.tree_count, target, &index)) nob_return_defer(BUMP_FAILED);
+
+  off_t offset = (off_t)(header.records_offset + index*header.record_size +
+                         (volume ? offsetof(Mori_V1_Record, volume) : offsetof(Mori_V1_Record, chapter)));
+  uint32_t value = 0;
+  memcpy(&value, buffer.items + offset, sizeof(value));
+  if (!bump_value(index, volume, &value)) nob_return_defer(BUMP_FAILED);
+  if (pwrite(fd, &value, sizeof(value), offset) != sizeof(value) || fdatasync(fd) < 0) {
+    nob_log(ERROR, "Could not update morimori file %s: %s", file_path, strerror(errno));
+    nob_return_defer(BUMP_FAILED);
   }
 
-  if (!read_morimori_file(sb, file_path)) return false;
+  printf("Mori_Tree[%zu].%s = %u;\n", index, volume ? "volume" : "chapter", value);
+
+defer:
+  if (bytes != MAP_FAILED) munmap(bytes, (size_t)st.st_size);
+  close(fd);
+  return result;
+}
+
+// A session that just quit hands the lock to its background compaction, `mori bump` right after that
+// should wait it out rather than fail
+#ifndef MORI_BUMP_LOCK_TIMEOUT_MS
+#define MORI_BUMP_LOCK_TIMEOUT_MS 3000
+#endif // MORI_BUMP_LOCK_TIMEOUT_MS
+
+bool bump_tree(const char *file_path, const char *target, bool volume) {
+  if (!open_journal(file_path, MORI_BUMP_LOCK_TIMEOUT_MS)) return false;
+
+  Bump_Result bumped = bump_tree_in_place(file_path, target, volume);
+  if (bumped != BUMP_NEEDS_LOAD) return bumped == BUMP_DONE;
+
+  nob_log(INFO, "Bumping through a full load of your 森");
+  if (!load_morimori_locked(&mori.buffer, file_path)) return false;
+
+  size_t index = 0;
+  if (!find_tree_index(&mori.buffer, NULL, mori.count, target, &index)) return false;
+
+  uint32_t *value = volume ? &mori_volume(index) : &mori_chapter(index);
+  if (!bump_value(index, volume, value)) return false;
+  mori_edited(index, false);
+  journal_append(MORI_JOURNAL_SET, index);
+  if (!save_morimori(file_path, NULL)) return false;
+
+  printf("Mori_Tree[%zu].%s = %u;\n", index, volume ? "volume" : "chapter", *value);
   return true;
 }
 
+// Tests include this file to get at its functions and bring their own main
+#ifndef MORI_NO_MAIN
 int main(int argc, char **argv) {
   int result = 0;
   shift(argv, argc);
@@ -767,62 +3528,211 @@ int main(int argc, char **argv) {
       nob_return_defer(0);
     }
 
-    if (strcmp(arg, "list") == 0) {
-      load_morimori_file(&mori.buffer, morimori_file_path);
-      display_mori_tree_short_list();
+    if (strcmp(arg, "bump") == 0) {
+      const char *target = NULL;
+      bool volume = false;
+      while (argc > 0) {
+	const char *bump_arg = shift(argv, argc);
+	if (strcmp(bump_arg, "--volume") == 0) volume = true;
+	else target = bump_arg;
+      }
+      if (!target) {
+	nob_log(ERROR, "Missing tree to bump");
+	printf("Usage: mori bump <index|name> [--volume]\n");
+	nob_return_defer(1);
+      }
+
+      nob_return_defer(bump_tree(morimori_file_path, target, volume) ? 0 : 1);
+    }
+
+    if (strcmp(arg, "bench-save") == 0) {
+      size_t runs = MORI_BENCH_SAVE_DEFAULT_RUNS;
+      while (argc > 0) {
+	const char *bench_arg = shift(argv, argc);
+	if (strncmp(bench_arg, "--runs=", 7) != 0 || !parse_index(bench_arg + 7, &runs) || runs == 0) {
+	  nob_log(ERROR, "Unknown argument: %s", bench_arg);
+	  printf("Usage: mori bench-save [--runs=N]\n");
+	  nob_return_defer(1);
+	}
+      }
+
+      open_morimori_file_read_only(&mori.buffer, morimori_file_path);
+      nob_return_defer(bench_save(morimori_file_path, runs) ? 0 : 1);
+    }
+
+    if (strcmp(arg, "stats") == 0) {
+      open_morimori_file_read_only(&mori.buffer, morimori_file_path);
+
+      uint64_t chapters = 0, volumes = 0;
+      for (size_t i = 0; i < mori.count; ++i) chapters += mori_chapter(i);
+      for (size_t i = 0; i < mori.count; ++i) volumes += mori_volume(i);
+
+      ansi_term_printn("Mori_Stats :: struct {");
+      ansi_term_printfn("  .Trees    = %zu;", mori.count);
+      ansi_term_printfn("  .Chapters = %llu;", (unsigned long long)chapters);
+      ansi_term_printfn("  .Volumes  = %llu;", (unsigned long long)volumes);
+      ansi_term_printn("}");
       nob_return_defer(0);
     }
 
-    if (strcmp(arg, "list-full") == 0) {
-      load_morimori_file(&mori.buffer, morimori_file_path);
-      display_mori_tree_full_list();
+    if (strcmp(arg, "list") == 0 || strcmp(arg, "list-full") == 0) {
+      Mori_Sort_Key sort = MORI_SORT_INDEX;
+      while (argc > 0) {
+	const char *list_arg = shift(argv, argc);
+	if (strncmp(list_arg, "--sort=", 7) != 0 || !mori_parse_sort_key(list_arg + 7, &sort)) {
+	  nob_log(ERROR, "Unknown argument: %s", list_arg);
+	  printf("Usage: mori %s [--sort=index|name|chapter|volume]\n", arg);
+	  nob_return_defer(1);
+	}
+      }
+
+      open_morimori_file_read_only(&mori.buffer, morimori_file_path);
+      if (strcmp(arg, "list") == 0) display_mori_tree_short_list(sort);
+      else display_mori_tree_full_list(sort);
       nob_return_defer(0);
     }
 
-    if (strcmp(arg, "search") == 0) {
-      if (argc == 0) {
-	nob_log(ERROR, "Missing search term(s)");
-	printf("Usage: mori search <search-terms...>\n");
+    if (strcmp(arg, "get") == 0) {
+      Mori_Exact_Field field = MORI_EXACT_COUNT;
+      if (argc == 2 && strcmp(argv[0], "--name") == 0) field = MORI_EXACT_NAME;
+      if (argc == 2 && strcmp(argv[0], "--url") == 0) field = MORI_EXACT_URL;
+      if (field == MORI_EXACT_COUNT) {
+	nob_log(ERROR, "Expected exactly one of --name or --url");
+	printf("Usage: mori get --name <name> | --url <url>\n");
 	nob_return_defer(1);
       }
+      open_morimori_file_read_only(&mori.buffer, morimori_file_path);
+
+      // Like search, a single lookup is served quicker by one scan than by building the index first
+      String_View sv = sv_from_cstr(argv[1]);
+      if (field == MORI_EXACT_NAME) sv = ntemp_sv_fold(sv);
+      uint32_t *matches = NULL;
+      size_t found = mori_exact_lookup(field, sv, &matches);
+      for (size_t m = 0; m < found; ++m) display_tree_full(matches[m], NULL);
+      ansi_term_frame_flush();
+      nob_return_defer(found ? 0 : 1);
+    }
 
-      load_morimori_file(&mori.buffer, morimori_file_path);
+    if (strcmp(arg, "dedupe") == 0) {
+      open_morimori_file_read_only(&mori.buffer, morimori_file_path);
+
+      uint32_t *groups = NULL, *groups_ends = NULL;
+      size_t groups_count = mori_dedupe(&groups, &groups_ends);
+      frame_line("", "╓<Near_Duplicates>");
+      for (size_t g = 0, m = 0; g < groups_count; ++g) {
+	frame_tree_heading("╟──◈ Group ", g);
+	for (; m < groups_ends[g]; ++m) {
+	  frame_tree_heading("║  ╟─ Index ", groups[m]);
+	  display_tree_full(groups[m], "║  ║    ");
+	}
+      }
+      frame_list_end("╙ Mori_Group found[", groups_count);
+      ansi_term_frame_flush();
+      nob_return_defer(0);
+    }
 
+    if (strcmp(arg, "search") == 0) {
+      bool fuzzy = false;
+      bool structured = false;
+      bool top_given = false;
+      size_t top = MORI_FUZZY_DEFAULT_TOP;
       String_Builder search_sb = {0};
       while (argc > 0) {
 	char *term = shift(argv, argc);
+	if (strcmp(term, "--fuzzy") == 0) {
+	  fuzzy = true;
+	  continue;
+	}
+	if (strcmp(term, "--query") == 0) {
+	  structured = true;
+	  continue;
+	}
+	if (strncmp(term, "--top=", 6) == 0) {
+	  if (!parse_index(term + 6, &top)) {
+	    nob_log(ERROR, "Invalid --top: %s", term + 6);
+	    sb_free(&search_sb);
+	    nob_return_defer(1);
+	  }
+	  top_given = true;
+	  continue;
+	}
 	if (search_sb.count) da_append(&search_sb, ' ');
-	sb_append_cstr(&search_sb, term);
+	// The shell already split the terms, spaces left in one of a query are kept in it
+	if (structured && strchr(term, ' ')) sb_appendf(&search_sb, "\"%s\"", term);
+	else sb_append_cstr(&search_sb, term);
+      }
+      if ((top_given && !fuzzy) || (structured && fuzzy)) {
+	nob_log(ERROR, structured && fuzzy ? "--query and --fuzzy can't be combined" : "--top only applies to --fuzzy searches");
+	printf("Usage: mori search [--query | --fuzzy [--top=N]] <search-terms...>\n");
+	sb_free(&search_sb);
+	nob_return_defer(1);
       }
+      if (search_sb.count == 0) {
+	nob_log(ERROR, "Missing search term(s)");
+	printf("Usage: mori search [--query | --fuzzy [--top=N]] <search-terms...>\n");
+	printf("    --query terms: words of the name, name:text, url:text, chapter<N, volume>=N, ...; -term negates\n");
+	nob_return_defer(1);
+      }
+
+      open_morimori_file_read_only(&mori.buffer, morimori_file_path);
+
       String_View sv = sb_to_sv(search_sb);
-      const char *search = ntemp_sv_ascii_to_lower(sv);
-      size_t found = 0;
-      ansi_term_printn("╓<Search_Results>");
-      for (size_t i = 0; i < mori.count; ++i) {
-	Mori_Tree *tree = mori.items + i;
-	const char *lowered_name = ntemp_sv_ascii_to_lower(bufsv_to_sv(tree->name));
-	if (zstr_includes_zstr(lowered_name, search)) {
-	  ansi_term_printfn("╟──◈ Index %zu", i);
-	  display_tree_short(i, "║      ");
-	  found++;
+      // A single query is served quicker by one scan than by building the trigram index first
+      String_View search = ntemp_sv_fold(sv);
+
+      if (fuzzy) {
+	Mori_Fuzzy_Match *fuzzy_matches = NULL;
+	size_t found = mori_fuzzy_search_names(search, top, &fuzzy_matches);
+	frame_line("", "╓<Fuzzy_Results>");
+	for (size_t m = 0; m < found; ++m) {
+	  ansi_term_frame_cstr("╟──◈ Index ");
+	  ansi_term_frame_u64(fuzzy_matches[m].index);
+	  ansi_term_frame_cstr(" (distance ");
+	  ansi_term_frame_u64(fuzzy_matches[m].distance);
+	  ansi_term_frame_cstr(")");
+	  ansi_term_frame_newline();
+	  display_tree_short(fuzzy_matches[m].index, "║      ");
 	}
+	frame_list_end("╙ Mori_Tree found[", found);
+	ansi_term_frame_flush();
+
+	sb_free(&search_sb);
+	nob_return_defer(0);
       }
 
-      ansi_term_printfn("╙ Mori_Tree found[%zu];", found);
-      flush();
+      uint32_t *matches = NULL;
+      size_t found = 0;
+      if (!mori_run_query(sv, structured, &matches, &found)) {
+	sb_free(&search_sb);
+	nob_return_defer(1);
+      }
+      frame_line("", "╓<Search_Results>");
+      for (size_t m = 0; m < found; ++m) {
+	frame_tree_heading("╟──◈ Index ", matches[m]);
+	display_tree_short(matches[m], "║      ");
+      }
+      frame_list_end("╙ Mori_Tree found[", found);
+      ansi_term_frame_flush();
 
+      sb_free(&search_sb);
       nob_return_defer(0);
     }
   }
 
   if (!load_morimori_file(&mori.buffer, morimori_file_path)) return 1;
+  mori_trigram_build();
+  mori_exact_build();
   cmd.items = malloc(GLOBAL_CMD_INIT_CAP);
   cmd.capacity = GLOBAL_CMD_INIT_CAP;
 
   ansi_term_start();
 
   char action = 0;
+  // Whatever compaction frees during the session is reported once the terminal is back
+  size_t reclaimed = 0;
   while (true) {
+    // Nothing allocated from ntemp outlives a frame
+    ntemp_reset();
     ansi_term_clear_screen();
 
     display_actions_menu();
@@ -846,22 +3756,30 @@ int main(int argc, char **argv) {
       NOB_FREE(sv.data);
     }
 
-    if (handle_action(&mori.buffer, action)) break;
+    if (handle_action(action)) break;
+    reclaimed += mori_maybe_compact_heap();
   }
 
   ansi_term_end();
 
   nob_log(INFO, "Saving morimori file...");
-  if (write_morimori_file(morimori_file_path)) {
+  if (save_morimori(morimori_file_path, &reclaimed)) {
     nob_log(INFO, "Saved your 森!");
   } else {
     nob_log(ERROR, "Failed to save your 森!");
   }
+  if (reclaimed) printf("Compacted your 森, reclaimed %zu bytes of its string heap\n", reclaimed);
+  Ntemp_Stats stats = ntemp_stats();
+  printf("Temporary memory peaked at %zu bytes (%zu bytes in %zu chunks)\n", stats.high_water, stats.capacity,
+         stats.chunks);
 
 defer:
-  sb_free(&mori.buffer);
+  ntemp_free();
+  close_journal();
+  unload_morimori();
   return result;
 }
+#endif // MORI_NO_MAIN
 
 #define ANSI_TERM_IMPLEMENTATION
 #include "ansi_term.h"
@@ -14,6 +14,9 @@ typedef enum {
   COMP_UNIT_FLAG_DEBUG_INFO   = 1 << 0,
   COMP_UNIT_FLAG_COMPILE_ONLY = 1 << 1,
   COMP_UNIT_FLAG_FSANITIZE    = 1 << 2,
+  COMP_UNIT_FLAG_COLUMNAR     = 1 << 3,
+  // Only the first input is compiled, the others are files it includes
+  COMP_UNIT_FLAG_SINGLE_FILE  = 1 << 4,
 } Comp_Unit_Flag;
 
 typedef struct {
@@ -27,10 +30,135 @@ typedef struct {
 
 bool build_demanded = false;
 
+// Every test is tests/<name>.c, it includes main.c with MORI_NO_MAIN and exits non-zero when a check fails
+static const char *tests[] = {
+  "journal",
+  "ext_sv",
+  "query",
+};
+
 void usage(const char *program) {
-  printf("Usage: %s [run|build]\n", program);
+  printf("Usage: %s [run|build|test]\n", program);
   printf("    run        ---        Execute program after compiling\n", program);
   printf("    build      ---        Force building of program\n", program);
+  printf("    test       ---        Build and run the tests\n");
+  printf("    -columnar  ---        Store the forest as separate columns instead of an array of trees (builds %s)\n", BUILD_FOLDER"/mori-columnar");
+}
+
+// Search keys fold utf-8 through a table mori_fold_table.h generated here: for every code point of the BMP a
+// delta to the one it folds to, stored in 256 entry pages so pages without any folding share a single page
+// of zeroes. Folding covers case (ascii, latin-1, latin extended-a, greek, cyrillic), fullwidth ascii to
+// ascii, halfwidth to fullwidth katakana and katakana to hiragana. Voiced sound marks are folded to their
+// combining form and mori_fold_voiced/mori_fold_semi_voiced give what they compose to with the kana before.
+#define FOLD_TABLE_PATH BUILD_FOLDER"/mori_fold_table.h"
+
+static const char *halfwidth_katakana[] = {
+  "。", "「", "」", "、", "・", "ヲ", "ァ", "ィ", "ゥ", "ェ", "ォ", "ャ", "ュ", "ョ", "ッ", "ー",
+  "ア", "イ", "ウ", "エ", "オ", "カ", "キ", "ク", "ケ", "コ", "サ", "シ", "ス", "セ", "ソ", "タ",
+  "チ", "ツ", "テ", "ト", "ナ", "ニ", "ヌ", "ネ", "ノ", "ハ", "ヒ", "フ", "ヘ", "ホ", "マ", "ミ",
+  "ム", "メ", "モ", "ヤ", "ユ", "ヨ", "ラ", "リ", "ル", "レ", "ロ", "ワ", "ン",
+};
+
+uint32_t decode_utf8_3(const char *s) {
+  return ((uint32_t)(s[0] & 0x0F) << 12) | ((uint32_t)(s[1] & 0x3F) << 6) | (uint32_t)(s[2] & 0x3F);
+}
+
+size_t utf8_length(uint32_t cp) {
+  return cp < 0x80 ? 1 : cp < 0x800 ? 2 : 3;
+}
+
+bool generate_fold_table(void) {
+  static uint32_t map[0x10000];
+  for (uint32_t cp = 0; cp < 0x10000; ++cp) map[cp] = cp;
+
+  for (uint32_t cp = 'A'; cp <= 'Z'; ++cp) map[cp] = cp + 32;
+  for (uint32_t cp = 0xC0; cp <= 0xDE; ++cp) if (cp != 0xD7) map[cp] = cp + 32;
+  for (uint32_t cp = 0x100; cp <= 0x12F; cp += 2) map[cp] = cp + 1;
+  for (uint32_t cp = 0x132; cp <= 0x137; cp += 2) map[cp] = cp + 1;
+  for (uint32_t cp = 0x139; cp <= 0x148; cp += 2) map[cp] = cp + 1;
+  for (uint32_t cp = 0x14A; cp <= 0x177; cp += 2) map[cp] = cp + 1;
+  for (uint32_t cp = 0x179; cp <= 0x17E; cp += 2) map[cp] = cp + 1;
+  map[0x178] = 0xFF;
+  for (uint32_t cp = 0x391; cp <= 0x3A9; ++cp) if (cp != 0x3A2) map[cp] = cp + 32;
+  map[0x3C2] = 0x3C3;
+  for (uint32_t cp = 0x400; cp <= 0x40F; ++cp) map[cp] = cp + 80;
+  for (uint32_t cp = 0x410; cp <= 0x42F; ++cp) map[cp] = cp + 32;
+
+  map[0x3000] = ' ';
+  for (uint32_t cp = 0xFF01; cp <= 0xFF5E; ++cp) map[cp] = cp - 0xFEE0;
+  for (size_t i = 0; i < ARRAY_LEN(halfwidth_katakana); ++i) map[0xFF61 + i] = decode_utf8_3(halfwidth_katakana[i]);
+  map[0xFF9E] = 0x3099;
+  map[0xFF9F] = 0x309A;
+  map[0x309B] = 0x3099;
+  map[0x309C] = 0x309A;
+  for (uint32_t cp = 0x30A1; cp <= 0x30F6; ++cp) map[cp] = cp - 0x60;
+
+  // Chains like fullwidth 'Ａ' -> 'A' -> 'a' are followed to the end so folding is a single lookup
+  for (uint32_t cp = 0; cp < 0x10000; ++cp) {
+    while (map[map[cp]] != map[cp]) map[cp] = map[map[cp]];
+    if (utf8_length(map[cp]) > utf8_length(cp)) {
+      nob_log(ERROR, "Folding U+%04X to U+%04X would make it longer", cp, map[cp]);
+      return false;
+    }
+  }
+
+  uint16_t voiced[0x60] = {0}, semi_voiced[0x60] = {0};
+  for (uint32_t cp = 0x304B; cp <= 0x3062; cp += 2) voiced[cp - 0x3040] = (uint16_t)(cp + 1);
+  for (uint32_t cp = 0x3064; cp <= 0x3068; cp += 2) voiced[cp - 0x3040] = (uint16_t)(cp + 1);
+  for (uint32_t cp = 0x306F; cp <= 0x307B; cp += 3) {
+    voiced[cp - 0x3040] = (uint16_t)(cp + 1);
+    semi_voiced[cp - 0x3040] = (uint16_t)(cp + 2);
+  }
+  voiced[0x3046 - 0x3040] = 0x3094;
+
+  String_Builder sb = {0};
+  sb_appendf(&sb, "// Generated by nob.c, do not edit\n");
+  sb_appendf(&sb, "#ifndef MORI_FOLD_TABLE_H\n#define MORI_FOLD_TABLE_H\n#include <stdint.h>\n\n");
+
+  uint8_t page_index[256] = {0};
+  size_t pages = 1;
+  String_Builder pages_sb = {0};
+  sb_appendf(&pages_sb, "  {0},\n");
+  for (uint32_t page = 0; page < 256; ++page) {
+    bool identity = true;
+    for (uint32_t lo = 0; lo < 256 && identity; ++lo) identity = map[page << 8 | lo] == (page << 8 | lo);
+    if (identity) continue;
+    page_index[page] = (uint8_t)pages++;
+    sb_appendf(&pages_sb, "  { // U+%02X00\n   ", page);
+    for (uint32_t lo = 0; lo < 256; ++lo) {
+      uint32_t cp = page << 8 | lo;
+      sb_appendf(&pages_sb, " %d,%s", (int32_t)map[cp] - (int32_t)cp, lo % 16 == 15 && lo != 255 ? "\n   " : "");
+    }
+    sb_appendf(&pages_sb, "\n  },\n");
+  }
+
+  sb_appendf(&sb, "static const uint8_t mori_fold_page_index[256] = {");
+  for (size_t i = 0; i < 256; ++i) sb_appendf(&sb, "%s%d,", i % 32 == 0 ? "\n  " : " ", page_index[i]);
+  sb_appendf(&sb, "\n};\n\n");
+  sb_appendf(&sb, "static const int32_t mori_fold_pages[%zu][256] = {\n", pages);
+  sb_append_buf(&sb, pages_sb.items, pages_sb.count);
+  sb_appendf(&sb, "};\n\n");
+
+  sb_appendf(&sb, "// What a hiragana from U+3040 on composes to followed by U+3099 / U+309A, 0 when it doesn't\n");
+  sb_appendf(&sb, "static const uint16_t mori_fold_voiced[0x60] = {");
+  for (size_t i = 0; i < 0x60; ++i) sb_appendf(&sb, "%s0x%04X,", i % 12 == 0 ? "\n  " : " ", voiced[i]);
+  sb_appendf(&sb, "\n};\n");
+  sb_appendf(&sb, "static const uint16_t mori_fold_semi_voiced[0x60] = {");
+  for (size_t i = 0; i < 0x60; ++i) sb_appendf(&sb, "%s0x%04X,", i % 12 == 0 ? "\n  " : " ", semi_voiced[i]);
+  sb_appendf(&sb, "\n};\n\n#endif // MORI_FOLD_TABLE_H\n");
+
+  // Only touched when it changes so it doesn't trigger rebuilds by itself
+  bool result = true;
+  String_Builder old = {0};
+  if (!file_exists(FOLD_TABLE_PATH) || !read_entire_file(FOLD_TABLE_PATH, &old) ||
+      old.count != sb.count || memcmp(old.items, sb.items, sb.count) != 0) {
+    nob_log(NOB_INFO, "Generating %s", FOLD_TABLE_PATH);
+    result = write_entire_file(FOLD_TABLE_PATH, sb.items, sb.count);
+  }
+  sb_free(old);
+  sb_free(pages_sb);
+  sb_free(sb);
+  return result;
 }
 
 bool build_if_needed(Cmd *cmd, Comp_Unit *unit) {
@@ -40,14 +168,16 @@ bool build_if_needed(Cmd *cmd, Comp_Unit *unit) {
     else nob_log(NOB_INFO, "Rebuild needed for: '%s'", unit->output_path);
 
     nob_cc(cmd);
-    cmd_append(cmd, "-Wall", "-Wextra");
+    cmd_append(cmd, "-Wall", "-Wextra", "-pthread", "-I"BUILD_FOLDER);
     bool compile_only = unit->flags & COMP_UNIT_FLAG_COMPILE_ONLY;
     if (unit->flags & COMP_UNIT_FLAG_DEBUG_INFO) nob_cmd_append(cmd, "-ggdb");
     if (unit->flags & COMP_UNIT_FLAG_FSANITIZE) nob_cmd_append(cmd, "-fsanitize=address,undefined");
+    if (unit->flags & COMP_UNIT_FLAG_COLUMNAR) nob_cmd_append(cmd, "-DMORI_COLUMNAR");
     if (compile_only) cmd_append(cmd, "-c");
     nob_cc_output(cmd, unit->output_path);
     for (size_t i = 0; i < unit->input_paths_count; ++i) {
       if (!compile_only && sv_end_with(sv_from_cstr(unit->input_paths[i]), ".h")) continue;
+      if (!compile_only && i > 0 && (unit->flags & COMP_UNIT_FLAG_SINGLE_FILE)) continue;
       nob_cc_inputs(cmd, unit->input_paths[i]);
     }
     nob_return_defer(cmd_run(cmd));
@@ -57,7 +187,7 @@ bool build_if_needed(Cmd *cmd, Comp_Unit *unit) {
 defer:
   unit->input_paths_count = 0;
   memset(unit, 0, sizeof(Comp_Unit));
-  return true;
+  return result;
 }
 
 int main(int argc, char **argv) {
@@ -65,7 +195,9 @@ int main(int argc, char **argv) {
 
   const char *program_name = shift(argv, argc);
   bool run_requested = false;
+  bool test_requested = false;
   bool use_debug = false;
+  bool use_columnar = false;
 
   while (argc > 0) {
     const char *arg = shift(argv, argc);
@@ -77,11 +209,20 @@ int main(int argc, char **argv) {
       build_demanded = true;
       continue;
     }
+    if (streq(arg, "test")) {
+      test_requested = true;
+      continue;
+    }
 
     if (streq(arg, "-g")) {
       use_debug = true;
       continue;
     }
+
+    if (streq(arg, "-columnar")) {
+      use_columnar = true;
+      continue;
+    }
     
     nob_log(ERROR, "Unknown argument provided to build system: %s", arg);
     usage(program_name);
@@ -90,18 +231,43 @@ int main(int argc, char **argv) {
 
   Cmd cmd = {0};
   if (!mkdir_if_not_exists(BUILD_FOLDER)) return 1;
+  if (!generate_fold_table()) return 1;
   Comp_Unit unit = {0};
 
-  unit.output_path = BUILD_FOLDER"/mori";
+  // Each layout has its own binary, switching layouts never picks up one built for the other
+  const char *layout_suffix = use_columnar ? "-columnar" : "";
+  const char *mori_path = temp_sprintf(BUILD_FOLDER"/mori%s", layout_suffix);
+  unit.output_path = mori_path;
   comp_unit_add_input(&unit, "./main.c");
   comp_unit_add_input(&unit, "./ext_sv.h");
   comp_unit_add_input(&unit, "./ansi_term.h");
+  comp_unit_add_input(&unit, FOLD_TABLE_PATH);
   unit.flags = COMP_UNIT_FLAG_FSANITIZE;
   if (use_debug) unit.flags |= COMP_UNIT_FLAG_DEBUG_INFO;
+  if (use_columnar) unit.flags |= COMP_UNIT_FLAG_COLUMNAR;
   if (!build_if_needed(&cmd, &unit)) return 1;
 
+  if (test_requested) {
+    for (size_t i = 0; i < ARRAY_LEN(tests); ++i) {
+      const char *test_path = temp_sprintf(BUILD_FOLDER"/test_%s%s", tests[i], layout_suffix);
+      unit.output_path = test_path;
+      comp_unit_add_input(&unit, temp_sprintf("./tests/%s.c", tests[i]));
+      comp_unit_add_input(&unit, "./main.c");
+      comp_unit_add_input(&unit, "./ext_sv.h");
+      comp_unit_add_input(&unit, "./ansi_term.h");
+      comp_unit_add_input(&unit, FOLD_TABLE_PATH);
+      unit.flags = COMP_UNIT_FLAG_FSANITIZE | COMP_UNIT_FLAG_SINGLE_FILE;
+      if (use_debug) unit.flags |= COMP_UNIT_FLAG_DEBUG_INFO;
+      if (use_columnar) unit.flags |= COMP_UNIT_FLAG_COLUMNAR;
+      if (!build_if_needed(&cmd, &unit)) return 1;
+
+      cmd_append(&cmd, test_path);
+      if (!cmd_run(&cmd)) return 1;
+    }
+  }
+
   if (run_requested) {
-    cmd_append(&cmd, BUILD_FOLDER"/mori");
+    cmd_append(&cmd, mori_path);
     if (!cmd_run(&cmd)) return 1;
   }
 
@@ -0,0 +1,118 @@
+// Substring search: every kernel of sv_find_buf() and sv_find_buf_ascii_ignore_case() has to give the
+// same answer as a plain byte by byte search. Lengths cover both sides of the 16 and 32 byte blocks of the
+// vector kernels, bytes are drawn from a small alphabet of mixed case letters and the bytes right around
+// 'A'-'Z' so matches, near misses and folding mistakes all show up. Every haystack is its own allocation
+// of the exact size so AddressSanitizer catches a kernel reading past it.
+#define MORI_NO_MAIN
+#include "../main.c"
+
+#define check(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1);                                                                \
+    }                                                                         \
+  } while (0)
+
+#define MAX_BASE_SIZE 72
+#define MAX_NEEDLE_SIZE 36
+#define TRIALS 24
+
+static const char alphabet[] = { 'a', 'A', 'b', 'B', 'z', 'Z', '@', '[', '`', '{', (char)0xC1, (char)0xE1, (char)0xDA, (char)0xFA };
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+uint32_t rng_next(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)(rng_state >> 32);
+}
+
+char flip_case(char c) {
+  if ('a' <= c && c <= 'z') return c - 32;
+  if ('A' <= c && c <= 'Z') return c + 32;
+  return c;
+}
+
+ptrdiff_t reference_find(const char *base, size_t base_size, const char *needle, size_t needle_size, bool ignore_case) {
+  for (size_t i = 0; i + needle_size <= base_size; ++i) {
+    size_t j = 0;
+    while (j < needle_size && (ignore_case ? tolower((unsigned char)base[i + j]) == tolower((unsigned char)needle[j])
+                                           : base[i + j] == needle[j])) j++;
+    if (j == needle_size) return (ptrdiff_t)i;
+  }
+  return -1;
+}
+
+typedef struct {
+  const char *name;
+  Ext_Sv_Find_Kernel kernel;
+} Kernel;
+
+size_t checked = 0;
+
+void check_all(Kernel *kernels, size_t kernels_count, const char *base, size_t base_size, const char *needle,
+               size_t needle_size) {
+  for (int ignore_case = 0; ignore_case <= 1; ++ignore_case) {
+    ptrdiff_t expected = needle_size == 0 ? 0 : reference_find(base, base_size, needle, needle_size, ignore_case);
+    Nob_String_View sv = sv_from_parts(base, base_size);
+    ptrdiff_t dispatched = ignore_case ? sv_find_buf_ascii_ignore_case(sv, needle, needle_size)
+                                       : sv_find_buf(sv, needle, needle_size);
+    if (dispatched != expected) {
+      fprintf(stderr, "dispatch: base %zu bytes, needle %zu bytes, ignore_case %d: got %td, expected %td\n",
+              base_size, needle_size, ignore_case, dispatched, expected);
+      exit(1);
+    }
+    // The kernels themselves are only called with a needle that fits, ext_sv_find() handles the rest
+    if (needle_size == 0 || base_size < needle_size) continue;
+    for (size_t k = 0; k < kernels_count; ++k) {
+      ptrdiff_t found = kernels[k].kernel(base, base_size, needle, needle_size, ignore_case);
+      if (found != expected) {
+        fprintf(stderr, "%s: base %zu bytes, needle %zu bytes, ignore_case %d: got %td, expected %td\n",
+                kernels[k].name, base_size, needle_size, ignore_case, found, expected);
+        exit(1);
+      }
+    }
+    checked++;
+  }
+}
+
+int main(void) {
+  Kernel kernels[3] = {0};
+  size_t kernels_count = 0;
+  kernels[kernels_count++] = (Kernel) { "scalar", ext_sv_find_fallback };
+#ifdef EXT_SV_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) kernels[kernels_count++] = (Kernel) { "sse2", ext_sv_find_sse2 };
+  if (__builtin_cpu_supports("avx2")) kernels[kernels_count++] = (Kernel) { "avx2", ext_sv_find_avx2 };
+#endif // EXT_SV_X86_SIMD
+
+  char needle[MAX_NEEDLE_SIZE] = {0};
+  for (size_t base_size = 0; base_size <= MAX_BASE_SIZE; ++base_size) {
+    for (size_t needle_size = 0; needle_size <= MAX_NEEDLE_SIZE; ++needle_size) {
+      for (size_t trial = 0; trial < TRIALS; ++trial) {
+        char *base = malloc(base_size ? base_size : 1);
+        check(base != NULL);
+        for (size_t i = 0; i < base_size; ++i) base[i] = alphabet[rng_next() % sizeof(alphabet)];
+        for (size_t i = 0; i < needle_size; ++i) needle[i] = alphabet[rng_next() % sizeof(alphabet)];
+
+        // Most trials plant the needle, in its own case or with some letters flipped, at a random spot
+        if (trial % 3 != 0 && needle_size <= base_size) {
+          size_t at = rng_next() % (base_size - needle_size + 1);
+          for (size_t i = 0; i < needle_size; ++i) {
+            base[at + i] = trial % 3 == 2 && rng_next() % 2 ? flip_case(needle[i]) : needle[i];
+          }
+        }
+
+        check_all(kernels, kernels_count, base, base_size, needle, needle_size);
+        free(base);
+      }
+    }
+  }
+
+  printf("ext_sv: ok, %zu searches across", checked);
+  for (size_t k = 0; k < kernels_count; ++k) printf(" %s", kernels[k].name);
+  printf("\n");
+  return 0;
+}
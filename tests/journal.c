@@ -0,0 +1,234 @@
+// Edit journal: the edits of a session are replayed over the mapped v1 snapshot they were made on and must
+// give the same forest as the session itself and as a full load. A torn or corrupt record ends the replay
+// right before it. The sorted views and the exact index built before the session have to follow its edits.
+#define MORI_NO_MAIN
+#include "../main.c"
+
+#define check(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1);                                                                \
+    }                                                                         \
+  } while (0)
+
+#define EDITS_COUNT 7
+
+// Every field of every tree, one line per tree
+char *dump_forest(void) {
+  String_Builder sb = {0};
+  for (size_t i = 0; i < mori.count; ++i) {
+    sb_appendf(&sb, BufSV_Fmt"|"BufSV_Fmt"|%u|%u\n", BufSV_Arg(mori_name(i)), BufSV_Arg(mori_url(i)),
+               mori_chapter(i), mori_volume(i));
+  }
+  sb_append_null(&sb);
+  return sb.items;
+}
+
+bool forest_is(const char *expected) {
+  char *forest = dump_forest();
+  bool result = strcmp(forest, expected) == 0;
+  free(forest);
+  return result;
+}
+
+void plant_tree(const char *name, const char *url, uint32_t chapter, uint32_t volume) {
+  mori_append((Mori_Tree) {
+    .name = mori_heap_push(sv_from_cstr(name)),
+    .url = mori_heap_push(sv_from_cstr(url)),
+    .chapter = chapter,
+    .volume = volume,
+  });
+}
+
+void edit_forest(size_t edit) {
+  switch (edit) {
+  case 0:
+    plant_tree("Vinland Saga", "https://example.com/vinland-saga", 1, 1);
+    journal_append(MORI_JOURNAL_CREATE, mori.count - 1);
+    break;
+  case 1:
+    mori_heap_set(&mori_name(2), sv_from_cstr("Bo"));
+    mori_edited(2, true);
+    journal_append(MORI_JOURNAL_SET, 2);
+    break;
+  case 2:
+    mori_heap_set(&mori_url(4), sv_from_cstr("https://example.com/a/much/longer/url/than/before"));
+    mori_edited(4, false);
+    journal_append(MORI_JOURNAL_SET, 4);
+    break;
+  case 3:
+    mori_delete_tree(0);
+    journal_append(MORI_JOURNAL_DELETE, 0);
+    break;
+  case 4:
+    mori_chapter(5) = 1234;
+    mori_edited(5, false);
+    journal_append(MORI_JOURNAL_SET, 5);
+    break;
+  case 5:
+    plant_tree("ブルーピリオド", "https://example.com/blue-period", 7, 2);
+    journal_append(MORI_JOURNAL_CREATE, mori.count - 1);
+    break;
+  case 6: {
+    size_t i = mori.count - 2;
+    mori_delete_tree(i);
+    journal_append(MORI_JOURNAL_DELETE, i);
+  } break;
+  default:
+    NOB_UNREACHABLE("edit_forest");
+  }
+}
+
+// The sorted views kept in step with the edits have to be the ones sorting the forest from scratch gives
+bool orders_kept(void) {
+  bool result = true;
+  uint32_t *kept[MORI_SORT_COUNT] = {0};
+  for (size_t key = MORI_SORT_NAME; key < MORI_SORT_COUNT; ++key) {
+    check(orders[key].ready);
+    if (orders[key].count != mori.count) result = false;
+    kept[key] = malloc(orders[key].count*sizeof(*kept[key]));
+    memcpy(kept[key], orders[key].items, orders[key].count*sizeof(*kept[key]));
+  }
+  mori_orders_free();
+  for (size_t key = MORI_SORT_NAME; key < MORI_SORT_COUNT; ++key) {
+    const uint32_t *sorted = mori_order((Mori_Sort_Key)key);
+    if (result && memcmp(sorted, kept[key], mori.count*sizeof(*sorted)) != 0) result = false;
+    free(kept[key]);
+  }
+  return result;
+}
+
+// The exact index kept in step with the edits has to find every name and url like a scan does, and hold
+// nothing else
+bool exact_kept(void) {
+  check(exact.ready);
+  for (size_t field = 0; field < MORI_EXACT_COUNT; ++field) {
+    size_t keys = 0;
+    for (size_t i = 0; i < mori.count; ++i) {
+      String_View key = mori_exact_key((Mori_Exact_Field)field, i);
+      if (key.count == 0) continue;
+      keys += 1;
+      uint32_t *indexed = NULL, *scanned = NULL;
+      size_t indexed_count = mori_exact_lookup((Mori_Exact_Field)field, key, &indexed);
+      exact.ready = false;
+      size_t scanned_count = mori_exact_lookup((Mori_Exact_Field)field, key, &scanned);
+      exact.ready = true;
+      if (indexed_count != scanned_count || memcmp(indexed, scanned, scanned_count*sizeof(*scanned)) != 0) return false;
+    }
+    if (exact.tables[field].count != keys || exact.hashes[field].count != mori.count) return false;
+  }
+  return true;
+}
+
+// Maps the snapshot and replays `journal_bytes` over it, the mapping has to survive the replay
+bool replays_to(const char *file_path, const char *journal_bytes, size_t journal_size, const char *expected,
+                size_t *valid_size) {
+  check(write_entire_file(get_journal_file_path(file_path), journal_bytes, journal_size));
+  check(map_morimori_file(&mori.buffer, file_path));
+  check(replay_journal(get_journal_file_path(file_path), valid_size));
+  check(mori.mapped_size > 0);
+  bool result = forest_is(expected);
+  unload_morimori();
+  return result;
+}
+
+int main(void) {
+  nob_minimal_log_level = NOB_ERROR;
+
+  char dir[] = "/tmp/mori-test-XXXXXX";
+  check(mkdtemp(dir) != NULL);
+  char *file_path = strdup(temp_sprintf("%s/%s", dir, MORI_FILE_NAME));
+  char *journal_path = strdup(get_journal_file_path(file_path));
+
+  for (uint32_t i = 0; i < 32; ++i) {
+    plant_tree(temp_sprintf("Tree %u", i), temp_sprintf("https://example.com/tree/%u", i), i, i/4);
+  }
+  check(write_morimori_file(file_path, NULL));
+  unload_morimori();
+
+  // The session: every edit is journaled, `states[e]` and `ends[e]` are the forest and the journal size
+  // once the first `e` edits are done
+  char *states[EDITS_COUNT + 1] = {0};
+  size_t ends[EDITS_COUNT + 1] = {0};
+  check(load_morimori_file(&mori.buffer, file_path));
+  for (size_t key = MORI_SORT_NAME; key < MORI_SORT_COUNT; ++key) mori_order((Mori_Sort_Key)key);
+  mori_exact_build();
+  states[0] = dump_forest();
+  ends[0] = journal.size;
+  for (size_t e = 0; e < EDITS_COUNT; ++e) {
+    edit_forest(e);
+    check(!journal.failed);
+    states[e + 1] = dump_forest();
+    ends[e + 1] = journal.size;
+  }
+  check(orders_kept());
+  check(exact_kept());
+  check(save_morimori(file_path, NULL));
+  close_journal();
+  unload_morimori();
+
+  String_Builder journal_bytes = {0};
+  check(read_entire_file(journal_path, &journal_bytes));
+  check(journal_bytes.count == ends[EDITS_COUNT]);
+  const char *expected = states[EDITS_COUNT];
+
+  // Replayed over the mapping, the new strings have to land in the overlay
+  check(open_morimori_file_read_only(&mori.buffer, file_path));
+  check(mori.mapped_size > 0);
+  check(mori.overlay.count > 0);
+  check(forest_is(expected));
+  mori_compact_heap();
+  check(mori.mapped_size == 0 && mori.overlay.count == 0);
+  check(forest_is(expected));
+  unload_morimori();
+
+  // Replayed over a full load of the snapshot
+  check(load_morimori_file(&mori.buffer, file_path));
+  check(forest_is(expected));
+  close_journal();
+  unload_morimori();
+
+  for (size_t e = 1; e <= EDITS_COUNT; ++e) {
+    size_t valid_size = 0;
+    size_t record_size = ends[e] - ends[e - 1];
+
+    // Torn right after the record header and right before the end of the record
+    size_t cuts[] = { ends[e - 1] + sizeof(Mori_Journal_Record) - 1, ends[e] - 1 };
+    for (size_t c = 0; c < ARRAY_LEN(cuts); ++c) {
+      check(replays_to(file_path, journal_bytes.items, cuts[c], states[e - 1], &valid_size));
+      check(valid_size == ends[e - 1]);
+    }
+
+    // A flipped byte anywhere in the record fails its checksum, the records after it are dropped too
+    for (size_t at = ends[e - 1]; at < ends[e]; at += record_size/4 + 1) {
+      journal_bytes.items[at] ^= 0x20;
+      check(replays_to(file_path, journal_bytes.items, journal_bytes.count, states[e - 1], &valid_size));
+      check(valid_size == ends[e - 1]);
+      journal_bytes.items[at] ^= 0x20;
+    }
+  }
+
+  // A record with a good checksum that doesn't fit the forest is rejected as well
+  {
+    Mori_Journal_Record record = { .op = MORI_JOURNAL_DELETE, .index = 1000 };
+    record.checksum = journal_record_checksum(&record, NULL);
+    String_Builder bad = {0};
+    sb_append_buf(&bad, journal_bytes.items, journal_bytes.count);
+    sb_append_buf(&bad, &record, sizeof(record));
+    size_t valid_size = 0;
+    check(replays_to(file_path, bad.items, bad.count, expected, &valid_size));
+    check(valid_size == journal_bytes.count);
+    sb_free(&bad);
+  }
+
+  unlink(journal_path);
+  unlink(file_path);
+  rmdir(dir);
+  for (size_t e = 0; e <= EDITS_COUNT; ++e) free(states[e]);
+  sb_free(&journal_bytes);
+  free(journal_path);
+  free(file_path);
+  printf("journal: ok\n");
+  return 0;
+}
@@ -0,0 +1,213 @@
+// Search queries: the plans mori_query_compile() and mori_query_compile_plain() make out of a search, what
+// running them over a small forest finds, and that the parallel scan finds the same trees as a single thread
+// whatever the number of partitions.
+#define MORI_NO_MAIN
+#include "../main.c"
+
+#define check(cond)                                                           \
+  do {                                                                        \
+    if (!(cond)) {                                                            \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      exit(1);                                                                \
+    }                                                                         \
+  } while (0)
+
+// The plan written back as terms, in the order it's evaluated in
+const char *describe_plan(const Mori_Query_Plan *plan) {
+  static const char *fields[] = { "chapter", "volume", "name", "url" };
+  static const char *cmps[] = { "=", "<", "<=", ">", ">=" };
+  String_Builder sb = {0};
+  for (size_t p = 0; p < plan->count; ++p) {
+    const Mori_Predicate *predicate = &plan->items[p];
+    if (p) da_append(&sb, ' ');
+    if (predicate->negated) da_append(&sb, '-');
+    sb_append_cstr(&sb, fields[predicate->field]);
+    if (predicate->field == MORI_FIELD_CHAPTER || predicate->field == MORI_FIELD_VOLUME) {
+      sb_appendf(&sb, "%s%u", cmps[predicate->cmp], predicate->number);
+    } else {
+      sb_appendf(&sb, ":[%.*s]", (int)predicate->text.count, predicate->text.count ? predicate->text.data : "");
+    }
+  }
+  const char *description = temp_sprintf("%.*s", (int)sb.count, sb.count ? sb.items : "");
+  sb_free(&sb);
+  return description;
+}
+
+void check_plan(const char *file, int line, const char *query, bool structured, const char *expected) {
+  Mori_Query_Plan plan = {0};
+  if (structured) {
+    if (!mori_query_compile(sv_from_cstr(query), &plan)) {
+      fprintf(stderr, "%s:%d: '%s' did not compile\n", file, line, query);
+      exit(1);
+    }
+  } else {
+    mori_query_compile_plain(sv_from_cstr(query), &plan);
+  }
+  const char *description = describe_plan(&plan);
+  if (strcmp(description, expected) != 0) {
+    fprintf(stderr, "%s:%d: '%s' compiled to\n  %s\nexpected\n  %s\n", file, line, query, description, expected);
+    exit(1);
+  }
+  da_free(plan);
+}
+
+#define check_query(query, expected) check_plan(__FILE__, __LINE__, query, true, expected)
+#define check_plain(query, expected) check_plan(__FILE__, __LINE__, query, false, expected)
+
+bool compiles(const char *query) {
+  Mori_Query_Plan plan = {0};
+  bool result = mori_query_compile(sv_from_cstr(query), &plan);
+  da_free(plan);
+  return result;
+}
+
+void plant_tree(const char *name, const char *url, uint32_t chapter, uint32_t volume) {
+  mori_append((Mori_Tree) {
+    .name = mori_heap_push(sv_from_cstr(name)),
+    .url = mori_heap_push(sv_from_cstr(url)),
+    .chapter = chapter,
+    .volume = volume,
+  });
+}
+
+// The indices found, space separated
+const char *run(const char *query, bool structured) {
+  uint32_t *matches = NULL;
+  size_t found = 0;
+  check(mori_run_query(sv_from_cstr(query), structured, &matches, &found));
+  String_Builder sb = {0};
+  for (size_t m = 0; m < found; ++m) sb_appendf(&sb, "%s%u", m ? " " : "", matches[m]);
+  const char *result = temp_sprintf("%.*s", (int)sb.count, sb.count ? sb.items : "");
+  sb_free(&sb);
+  return result;
+}
+
+#define SCAN_TREES 50000
+
+static const char *words[] = { "black", "clover", "chainsaw", "man", "blue", "period", "berserk", "dungeon" };
+
+uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+uint32_t rng_next(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)(rng_state >> 32);
+}
+
+void check_parallel_scan(const char *query) {
+  Mori_Query_Plan plan = {0};
+  check(mori_query_compile(sv_from_cstr(query), &plan));
+
+  // One tree at a time, every predicate
+  uint32_t *expected = malloc(mori.count*sizeof(*expected));
+  uint32_t *matches = malloc(mori.count*sizeof(*matches));
+  size_t expected_count = 0;
+  for (size_t i = 0; i < mori.count; ++i) {
+    bool holds = true;
+    for (size_t p = 0; p < plan.count && holds; ++p) holds = mori_predicate_holds(&plan.items[p], i);
+    if (holds) expected[expected_count++] = (uint32_t)i;
+  }
+
+  // Over the whole forest, then over the trigram candidates of a name term like mori_run_query() does
+  for (size_t indexed = 0; indexed < 2; ++indexed) {
+    size_t skipped = plan.count;
+    uint32_t *candidates = NULL;
+    size_t count = mori.count;
+    if (indexed) {
+      for (size_t p = 0; p < plan.count && skipped == plan.count; ++p) {
+        const Mori_Predicate *predicate = &plan.items[p];
+        if (predicate->field == MORI_FIELD_NAME && !predicate->negated && predicate->text.count >= 3) skipped = p;
+      }
+      if (skipped == plan.count) continue;
+      count = mori_search_names(plan.items[skipped].text, &candidates);
+    }
+
+    size_t workers[] = { 1, 2, 3, 4, 7, 8, 16, 64 };
+    for (size_t w = 0; w < ARRAY_LEN(workers); ++w) {
+      size_t found = mori_scan_partitioned(&plan, skipped, candidates, count, matches, workers[w]);
+      if (found != expected_count || memcmp(matches, expected, found*sizeof(*matches)) != 0) {
+        fprintf(stderr, "'%s' with %zu workers%s: found %zu trees, expected %zu\n", query, workers[w],
+                indexed ? " over trigram candidates" : "", found, expected_count);
+        exit(1);
+      }
+    }
+  }
+
+  free(expected);
+  free(matches);
+  da_free(plan);
+}
+
+int main(void) {
+  nob_minimal_log_level = NOB_ERROR;
+
+  // Terms are ordered by field, cheapest first, and keep their order within a field
+  check_query("Berserk", "name:[berserk]");
+  check_query("url:MangaDex chapter>=300 volume<2 name:Guts -chapter=7",
+              "chapter>=300 -chapter=7 volume<2 name:[guts] url:[MangaDex]");
+  check_query("chapter:5 chapter=5 chapter<=5 chapter<5 chapter>5 chapter>=5",
+              "chapter=5 chapter=5 chapter<=5 chapter<5 chapter>5 chapter>=5");
+  check_query("volume=4294967295", "volume=4294967295");
+
+  // Bare words are joined into one name term after the others, quotes keep spaces inside of a term
+  check_query("Black \"Clover  Quartet\" url:x Knights", "name:[black clover  quartet knights] url:[x]");
+  check_query("-Berserk Guts", "-name:[berserk] name:[guts]");
+  check_query("- chapters volume", "name:[- chapters volume]");
+  check_query("name:ＢＥＲＳＥＲＫ", "name:[berserk]");
+  check_query("", "");
+
+  // Bad numbers are logged as they're found, they're expected here
+  nob_minimal_log_level = NOB_NO_LOGS;
+  check(!compiles("chapter>x"));
+  check(!compiles("chapter>"));
+  check(!compiles("volume=4294967296"));
+  check(!compiles("-volume<-1"));
+  nob_minimal_log_level = NOB_ERROR;
+
+  // Plain searches are a single name term whatever they contain
+  check_plain("Berserk", "name:[berserk]");
+  check_plain("\"Black Clover\" -Guts chapter>3", "name:[\"black clover\" -guts chapter>3]");
+  check_plain("-Man", "name:[-man]");
+  check_plain("", "name:[]");
+
+  plant_tree("Berserk", "https://example.com/berserk", 364, 41);
+  plant_tree("-Man", "https://mangadex.org/-man", 12, 2);
+  plant_tree("\"Quoted\" Manga", "", 3, 1);
+  plant_tree("Black Clover", "https://mangadex.org/black-clover", 370, 36);
+  plant_tree("Chainsaw Man", "https://example.com/chainsaw-man", 150, 16);
+
+  check(strcmp(run("-Man", false), "1") == 0);
+  check(strcmp(run("-Man", true), "0 3") == 0);
+  check(strcmp(run("\"Quoted\"", false), "2") == 0);
+  check(strcmp(run("\"Quoted\"", true), "2") == 0);
+  check(strcmp(run("man", false), "1 2 4") == 0);
+  check(strcmp(run("man url:mangadex", true), "1") == 0);
+  check(strcmp(run("man url:mangadex", false), "") == 0);
+  check(strcmp(run("chapter>=150 volume<40", true), "3 4") == 0);
+  check(strcmp(run("-url:example chapter<100", true), "1 2") == 0);
+
+  unload_morimori();
+
+  for (size_t i = 0; i < SCAN_TREES; ++i) {
+    const char *name = temp_sprintf("%s %s %zu", words[rng_next() % ARRAY_LEN(words)], words[rng_next() % ARRAY_LEN(words)], i);
+    const char *url = rng_next() % 3 ? temp_sprintf("https://mangadex.org/%zu", i) : "";
+    plant_tree(name, url, rng_next() % 400, rng_next() % 50);
+    nob_temp_reset();
+  }
+  mori_trigram_build();
+  const char *scans[] = {
+    "chapter>=200",
+    "black",
+    "clover -man volume<25",
+    "url:mangadex chapter<100 blue",
+    "-url:dex",
+    "nothing-has-this",
+    "",
+  };
+  for (size_t q = 0; q < ARRAY_LEN(scans); ++q) check_parallel_scan(scans[q]);
+
+  unload_morimori();
+  printf("query: ok\n");
+  return 0;
+}